@@ -1,9 +1,9 @@
-#include <vector>
-#include "Common.h"
-
 #ifndef ARRAY2D_H
 #define ARRAY2D_H
 
+#include <vector>
+#include "Common.h"
+
 template<typename T>
 class Array2D
 {
@@ -66,7 +66,7 @@ public:
 	}
 
 	//Clear data
-	void Clear() { dims = uvec2(0); data.clear() }
+	void Clear() { dims = uvec2(0); data.clear(); }
 
 	//Add row or column
 	void AddRows(unsigned n, const T& elem = T())
@@ -86,12 +86,12 @@ public:
 	}
 	void RemoveRows(unsigned n)
 	{
-		dims.x = max(dims.x - n, 0);
+		dims.x = dims.x > n ? dims.x - n : 0;
 		data.resize(dims.x * dims.y);
 	}
 	void RemoveColumns(unsigned n)
 	{
-		int newY = max(dims.y - n, 0);
+		int newY = dims.y > n ? dims.y - n : 0;
 		for (int i = 1; i < dims.x; i++)
 		for (int j = 0; j < newY; j++)
 		{
@@ -118,10 +118,11 @@ public:
 	//Fill
 	void Fill(const T& element)
 	{
-		for (i : data) i = element;
+		for (auto& i : data) i = element;
 	}
 
 	//Getters
+	T* GetRawPointer() { return data.data(); }
 	const T* GetRawPointer() const { return data.data(); }
 	const vector<T>& GetPlainData() const { return data; }
 	uvec2 GetSize() const { return dims; }
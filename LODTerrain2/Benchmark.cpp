@@ -0,0 +1,870 @@
+/*
+	This file defines the entry point of the benchmark of terrain LOD hot paths:
+	  - LOD selection (Terrain::Renew and incremental Terrain::Update) over a camera path,
+	    number of selected nodes for different screen-space error tolerances
+	  - per-node vertex generation (Terrain::BuildNodeVertices) from float and 16-bit heights
+	    and morph targets (Terrain::BuildMorphTargets)
+	  - index generation (Terrain::GenerateIndices) for different LOD resolutions in row order
+	    and with vertex cache optimisation, and ACMR of the indices in simulated FIFO caches
+	  - indirect draw commands building (Terrain::BuildDrawCommands)
+	  - incremental LOD selection with frustum culling for a camera looking along the path
+	  - streaming: writing and opening of terrain pyramid and incremental LOD selection
+	    with nodes streamed from it under a memory budget of a quarter of all nodes
+	  - heightmap loading (Image::Load to colors, TGAFile::ReadHeights to 16-bit height grid)
+
+	Results are checked along the way: ACMR of sequences with known cache misses,
+	ranges of the ring allocator used for uploads,
+	residency of nodes after every frame of CachedUpdate and StreamUpdate (drawn nodes and
+	parents of resident nodes are resident, resident nodes fit into the cache capacity,
+	pending nodes match requests of the load scheduler)
+	and convergence of their selection to the in-memory one at the end of the path,
+	draw commands executed on the CPU for terrain uploaded to memory by a GL-free uploader.
+	Failed checks are reported in the output and make the exit code nonzero.
+
+	Usage: lodterrain_benchmark [options]
+	  --sizes 1024,2048,4096   heightmap sizes in samples per side
+	  --lod-res 16,32,64,128   LOD resolutions used for index generation
+	  --max-lod N              depth of the terrain quadtree
+	  --path file              camera path, one "x y z" viewpoint per line
+	  --frames N               length of the generated camera path
+	  --no-load                skip heightmap loading benchmark
+
+	Heightmaps are generated in memory, so sizes are limited by RAM only
+	(TGA files used by loading benchmark can't exceed 65535 samples per side).
+*/
+
+#include "RingAllocator.h"
+#include "Terrain.h"
+#include "TGALoader.h"
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+//
+//Allocations counting
+//
+static atomic<uint64> g_Allocations(0);
+static atomic<uint64> g_AllocatedBytes(0);
+
+void* operator new(size_t size)
+{
+	g_Allocations++;
+	g_AllocatedBytes += size;
+	if (void* ptr = malloc(size ? size : 1))
+		return ptr;
+	throw bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+//
+//Measurements
+//
+typedef chrono::steady_clock BenchmarkClock;
+
+struct Measurement
+{
+	//Duration of each operation in nanoseconds
+	vector<double> samples;
+	uint64 allocations = 0;
+	uint64 allocatedBytes = 0;
+	uint64 visitedNodes = 0;
+	uint64 reevaluatedNodes = 0;
+};
+
+//Starts counting of time and allocations, finishes it on destruction
+class Probe
+{
+public:
+	Probe(Measurement& m) :
+		m(m),
+		allocations(g_Allocations),
+		allocatedBytes(g_AllocatedBytes),
+		start(BenchmarkClock::now()) {}
+	~Probe()
+	{
+		BenchmarkClock::time_point finish = BenchmarkClock::now();
+		m.allocations += g_Allocations - allocations;
+		m.allocatedBytes += g_AllocatedBytes - allocatedBytes;
+		m.samples.push_back(static_cast<double>(
+			chrono::duration_cast<chrono::nanoseconds>(finish - start).count()
+			));
+	}
+
+private:
+	Measurement& m;
+	uint64 allocations;
+	uint64 allocatedBytes;
+	BenchmarkClock::time_point start;
+};
+
+double Percentile(const vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+void PrintHeader()
+{
+	printf("%-36s %8s %12s %12s %12s %12s %12s %10s %12s %10s %10s\n",
+		"benchmark", "ops", "ns/op", "p50", "p90", "p99", "max",
+		"allocs/op", "bytes/op", "nodes/op", "evals/op");
+}
+
+void PrintMeasurement(const string& name, const Measurement& m)
+{
+	vector<double> sorted = m.samples;
+	sort(sorted.begin(), sorted.end());
+	double ops = static_cast<double>(std::max<size_t>(sorted.size(), 1));
+	double total = 0.0;
+	for (double s : sorted)
+		total += s;
+	printf("%-36s %8u %12.0f %12.0f %12.0f %12.0f %12.0f %10.1f %12.0f %10.1f %10.1f\n",
+		name.c_str(),
+		static_cast<unsigned>(sorted.size()),
+		total / ops,
+		Percentile(sorted, 0.5),
+		Percentile(sorted, 0.9),
+		Percentile(sorted, 0.99),
+		sorted.empty() ? 0.0 : sorted.back(),
+		m.allocations / ops,
+		m.allocatedBytes / ops,
+		m.visitedNodes / ops,
+		m.reevaluatedNodes / ops);
+	fflush(stdout);
+}
+
+void PrintCacheStatistics(const string& name, const Terrain& terrain)
+{
+	const TerrainCacheStatistics& statistics = terrain.GetCacheStatistics();
+	printf("%-36s cache hit rate %.3f, %s insertions, %s evictions, peak %s bytes resident\n",
+		name.c_str(),
+		statistics.GetHitRate(),
+		ToString(statistics.insertions).c_str(),
+		ToString(statistics.evictions).c_str(),
+		ToString(statistics.peakResidentBytes).c_str());
+	TerrainLoadStatistics loads = terrain.GetLoadStatistics();
+	printf("%-36s loads %s, cancelled %s, max queue %s, latency ms p50 %.3f p90 %.3f p99 %.3f\n",
+		name.c_str(),
+		ToString(loads.completed).c_str(),
+		ToString(loads.cancelled).c_str(),
+		ToString(loads.maxQueueDepth).c_str(),
+		terrain.GetLoadLatencyPercentile(0.5),
+		terrain.GetLoadLatencyPercentile(0.9),
+		terrain.GetLoadLatencyPercentile(0.99));
+	fflush(stdout);
+}
+
+//
+//Checks of results, the benchmark fails if any of them doesn't hold
+//
+static int g_FailedChecks = 0;
+
+void Check(bool condition, const string& name, const char* description)
+{
+	if (condition)
+		return;
+	printf("%-36s CHECK FAILED: %s\n", name.c_str(), description);
+	fflush(stdout);
+	g_FailedChecks++;
+}
+
+//ACMR of short sequences with known numbers of misses
+void CheckVertexCache()
+{
+	VertexCache cache(4);
+	//Second triangle reuses two vertices kept by the cache of four
+	const uint32_t reused[] = { 0, 1, 2, 3, 0, 1 };
+	Check(cache.ComputeACMR(reused, 6) == 2.0f, "VertexCache", "FIFO 4 keeps the last four vertices");
+	//Fifth vertex pushes the first one out
+	const uint32_t evicted[] = { 0, 1, 2, 3, 4, 0 };
+	Check(cache.ComputeACMR(evicted, 6) == 3.0f, "VertexCache", "FIFO 4 evicts the oldest of five vertices");
+}
+
+//Ranges of a ring of 256 bytes: aligned allocation, wraparound which skips the end,
+//allocation which doesn't fit until older groups are retired and fences signaled out of order
+void CheckRingAllocator()
+{
+	const string name = "RingAllocator";
+	RingAllocator ring(256, 16);
+	bool signaled[4] = { false, false, false, false };
+	auto isSignaled = [&](uint64 fence) { return signaled[fence]; };
+	size_t a = 1, b = 1, c = 1, d = 1;
+	Check(ring.Allocate(100, a) && ring.Allocate(50, b) && a == 0 && b == 112,
+		name, "allocations are aligned and follow each other");
+	Check(ring.GetUsedSize() == 162 && ring.Fence(1), name, "used size includes alignment");
+	Check(ring.Allocate(60, c) && c == 176 && ring.Fence(2), name, "allocation fits before the end");
+	signaled[1] = true;
+	Check(ring.Retire(isSignaled) == 1 && ring.GetUsedSize() == 74, name, "signaled group is retired");
+	//40 bytes don't fit after offset 240, the last 20 bytes of the ring are skipped
+	Check(ring.Allocate(40, d) && d == 0 && ring.GetUsedSize() == 134 && ring.Fence(3),
+		name, "allocation wraps to the start and the end is counted as used");
+	size_t e = 1;
+	Check(!ring.Allocate(200, e) && e == 1 && ring.GetUsedSize() == 134 && ring.GetOpenSize() == 0,
+		name, "allocation larger than the free space fails without change");
+	//Fence 3 is signaled before fence 2, groups are still retired in order
+	signaled[3] = true;
+	uint64 oldest = 0;
+	Check(ring.Retire(isSignaled) == 0 && ring.GetOldestFence(oldest) && oldest == 2 &&
+		ring.GetUsedSize() == 134, name, "newer fence doesn't retire groups before the oldest one");
+	signaled[2] = true;
+	Check(ring.Retire(isSignaled) == 2 && ring.GetUsedSize() == 0 && ring.GetFencesCount() == 0,
+		name, "oldest fence retires the waiting groups");
+	Check(ring.Allocate(200, e) && e == 0, name, "empty ring allocates from the start");
+}
+
+//Invariants of LOD selection with the node cache after every frame: drawn nodes are resident,
+//parents of resident nodes are resident, resident nodes fit into the capacity,
+//every pending node has one request in the load scheduler
+void CheckResidency(const string& name, const Terrain& terrain)
+{
+	const vector<TerrainNode>& nodes = terrain.heightmap.GetNodes();
+	bool drawnResident = true;
+	for (const TerrainRenderItem& item : terrain.GetRenderList())
+		drawnResident = drawnResident && nodes[item.node].resident;
+	bool parentsResident = true;
+	size_t residentCount = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (!nodes[i].resident)
+			continue;
+		residentCount++;
+		if (i > 0)
+			parentsResident = parentsResident && terrain.heightmap.Node(i).Parent()->resident;
+	}
+	Check(drawnResident, name, "drawn nodes are resident");
+	Check(parentsResident, name, "parents of resident nodes are resident");
+	Check(residentCount == terrain.GetResidentNodesCount(), name, "resident nodes are counted by the cache");
+	Check(residentCount <= terrain.GetCacheCapacity(), name, "resident nodes fit into the cache capacity");
+	TerrainLoadStatistics loads = terrain.GetLoadStatistics();
+	Check(terrain.GetPendingNodesCount() == loads.queueDepth + loads.inFlight, name, "pending nodes are queued or being loaded");
+}
+
+//Selection with the node cache must come to the in-memory one, once loading of nodes
+//wanted at the viewpoint is finished
+void CheckConvergence(const string& name, Terrain& terrain, Terrain& reference, const vec3& viewpoint)
+{
+	for (int i = 0; i < 1000; i++)
+	{
+		terrain.Update(viewpoint);
+		if (terrain.GetPendingNodesCount() == 0)
+			break;
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	terrain.Update(viewpoint);
+	CheckResidency(name, terrain);
+	reference.Update(viewpoint);
+	vector<pair<uint32_t, uint32_t> > selected, expected;
+	for (const TerrainRenderItem& item : terrain.GetRenderList())
+		selected.push_back(make_pair(item.node, item.stitchMask));
+	for (const TerrainRenderItem& item : reference.GetRenderList())
+		expected.push_back(make_pair(item.node, item.stitchMask));
+	sort(selected.begin(), selected.end());
+	sort(expected.begin(), expected.end());
+	Check(selected == expected, name, "selection converges to the in-memory render list");
+}
+
+//Uploader keeping terrain geometry in memory instead of GPU: indices and vertices
+//of all nodes packed in one array in the heightmap storage order, like the batched GL uploader
+class NullTerrainUploader : public TerrainUploader
+{
+public:
+	vector<uint32_t> indices;
+	vector<vec3> vertices;
+	vector<bool> uploaded;
+	size_t verticesPerNode = 0;
+
+	void UploadIndices(const void* data, size_t count, size_t indexSize) override
+	{
+		indices.resize(count);
+		for (size_t i = 0; i < count; i++)
+			indices[i] = indexSize == sizeof(uint16_t) ?
+				static_cast<const uint16_t*>(data)[i] :
+				static_cast<const uint32_t*>(data)[i];
+	}
+	void UnloadIndices() override { indices.clear(); }
+	void Reserve(size_t nodesCount, size_t nodeVertices) override
+	{
+		verticesPerNode = nodeVertices;
+		vertices.assign(nodesCount * nodeVertices, vec3(0.0f));
+		uploaded.assign(nodesCount, false);
+	}
+	void UploadNode(
+		size_t index,
+		TerrainNode& /*node*/,
+		const vector<vec3>& nodeVertices,
+		const vector<vec3>& /*colors*/,
+		const vector<vec2>& /*morphTargets*/
+		) override
+	{
+		copy(nodeVertices.begin(), nodeVertices.end(), vertices.begin() + index * verticesPerNode);
+		uploaded[index] = true;
+	}
+	void UnloadNode(TerrainNode& /*node*/) override {}
+};
+
+//Execute draw commands on the CPU: every command draws its node of the render list with the set
+//of indices of its stitching mask, and instance data of its position in the render list.
+//Indices address only uploaded vertices of the node inside its bounds, and sparse edges
+//skip every second vertex
+void CheckDrawCommands(
+	const string& name,
+	const Terrain& terrain,
+	const NullTerrainUploader& uploader,
+	const vector<TerrainDrawCommand>& commands,
+	bool sharedVertices
+	)
+{
+	const int res = terrain.lodResolution, size = res + 1;
+	const vector<TerrainRenderItem>& items = terrain.GetRenderList();
+	const vector<vec3>& instances = terrain.GetRenderInstances();
+	Check(commands.size() == items.size(), name, "one draw command per node of the render list");
+	bool fields = true, ranges = true, stitching = true;
+	for (size_t i = 0; i < commands.size() && i < items.size(); i++)
+	{
+		const TerrainDrawCommand& command = commands[i];
+		const TerrainRenderItem& item = items[i];
+		//Each sparse edge has res / 2 triangles less than a dense one
+		uint32_t sparseEdges = static_cast<uint32_t>(bitset<4>(item.stitchMask).count());
+		int32_t baseVertex = sharedVertices ? 0 : static_cast<int32_t>(item.node * uploader.verticesPerNode);
+		fields = fields &&
+			command.count == 3 * (2 * res * res - sparseEdges * res / 2) &&
+			command.instanceCount == 1 &&
+			command.firstIndex == static_cast<uint32_t>(res * res * 6) * item.stitchMask &&
+			command.baseVertex == baseVertex &&
+			command.baseInstance == i;
+		if (!fields || command.firstIndex + command.count > uploader.indices.size())
+			break;
+		ranges = ranges && (sharedVertices || uploader.uploaded[item.node]);
+		vec3 instance = instances[command.baseInstance];
+		for (uint32_t k = 0; k < command.count; k++)
+		{
+			uint32_t local = uploader.indices[command.firstIndex + k];
+			if (local >= uploader.verticesPerNode)
+			{
+				ranges = false;
+				break;
+			}
+			if (!sharedVertices)
+			{
+				//Node vertices are in terrain space, x and z lie inside the instance
+				const vec3& vertex = uploader.vertices[command.baseVertex + local];
+				const float epsilon = 1e-5f;
+				ranges = ranges &&
+					vertex.x >= instance.x - epsilon && vertex.x <= instance.x + instance.z + epsilon &&
+					vertex.z >= instance.y - epsilon && vertex.z <= instance.y + instance.z + epsilon;
+			}
+			int row = local / size, column = local % size;
+			stitching = stitching &&
+				!((item.stitchMask & TERRAIN_GRID_SPARSE_UPPER) && row == 0 && column % 2 == 1) &&
+				!((item.stitchMask & TERRAIN_GRID_SPARSE_RIGHT) && column == res && row % 2 == 1) &&
+				!((item.stitchMask & TERRAIN_GRID_SPARSE_LOWER) && row == res && column % 2 == 1) &&
+				!((item.stitchMask & TERRAIN_GRID_SPARSE_LEFT) && column == 0 && row % 2 == 1);
+		}
+	}
+	Check(fields, name, "count, firstIndex, baseVertex and baseInstance match the stitching mask and node");
+	Check(ranges, name, "indices address uploaded vertices of the node inside its bounds");
+	Check(stitching, name, "sparse edges skip every second vertex");
+}
+
+//
+//Input data
+//
+struct BenchmarkOptions
+{
+	vector<unsigned> sizes = { 1024, 2048, 4096 };
+	vector<int> lodResolutions = { 16, 32, 64, 128 };
+	int maxLOD = DEFAULT_LOD_MAXIMUM;
+	string pathFile;
+	int frames = 600;
+	bool benchmarkLoading = true;
+};
+
+//Deterministic synthetic heightmap with features of different scale
+void GenerateHeightmap(HeightGrid& hmap, unsigned size)
+{
+	hmap.Resize(uvec2(size));
+	vector<float> row(size);
+	for (unsigned i = 0; i < size; i++)
+	{
+		for (unsigned j = 0; j < size; j++)
+		{
+			float x = static_cast<float>(i) / size, y = static_cast<float>(j) / size;
+			row[j] =
+				0.5f +
+				0.25f * sin(x * 6.2832f) * cos(y * 6.2832f) +
+				0.15f * sin(x * 31.4159f + 1.0f) * sin(y * 25.1327f) +
+				0.05f * cos(x * 201.0619f) * sin(y * 163.3628f + 2.0f);
+		}
+		hmap.SetRow(i, row.data());
+	}
+}
+
+//Flight over the terrain placed like in the viewer application
+vector<vec3> GenerateCameraPath(int frames)
+{
+	vector<vec3> path(frames);
+	for (int i = 0; i < frames; i++)
+	{
+		float t = static_cast<float>(i) / frames * 6.2832f;
+		path[i] = vec3(
+			50.0f + 25.0f * cos(t),
+			11.0f + 9.0f * sin(3.0f * t),
+			40.0f + 25.0f * sin(t)
+			);
+	}
+	return path;
+}
+
+bool LoadCameraPath(const string& filename, vector<vec3>& path)
+{
+	FILE* file = fopen(filename.c_str(), "r");
+	if (!file)
+		return false;
+	vec3 p;
+	while (fscanf(file, "%f %f %f", &p.x, &p.y, &p.z) == 3)
+		path.push_back(p);
+	fclose(file);
+	return !path.empty();
+}
+
+//Writes uncompressed 24-bit TGA readable by Image::Load
+bool WriteHeightmapTGA(const string& filename, const HeightGrid& hmap)
+{
+	uvec2 size = hmap.GetSize();
+	if (size.x > 0xFFFF || size.y > 0xFFFF)
+		return false;
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+		return false;
+	uint8_t header[18] = { 0 };
+	header[2] = 2;
+	header[12] = size.x & 0xFF; header[13] = size.x >> 8;
+	header[14] = size.y & 0xFF; header[15] = size.y >> 8;
+	header[16] = 24;
+	fwrite(header, 1, sizeof(header), file);
+	vector<uint8_t> row(size.x * 3);
+	for (unsigned i = 0; i < size.y; i++)
+	{
+		for (unsigned j = 0; j < size.x; j++)
+		{
+			uint8_t h = static_cast<uint8_t>(clamp(hmap.At(i, j), 0.0f, 1.0f) * 255.0f);
+			row[3 * j] = row[3 * j + 1] = row[3 * j + 2] = h;
+		}
+		fwrite(row.data(), 1, row.size(), file);
+	}
+	fclose(file);
+	return true;
+}
+
+//
+//Benchmarks
+//
+void CollectNodes(const QuadTree<TerrainNode>::Iterator& node, vector<QuadTree<TerrainNode>::Iterator>& nodes)
+{
+	nodes.push_back(node);
+	for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+		if (node.Child(i))
+			CollectNodes(node.Child(i), nodes);
+}
+
+void BenchmarkTerrain(const BenchmarkOptions& options, const vector<vec3>& path, unsigned size)
+{
+	string suffix = "/" + ToString(size);
+
+	HeightGrid hmap;
+	GenerateHeightmap(hmap, size);
+
+	Terrain terrain(DEFAULT_LOD_RESOLUTION, options.maxLOD);
+	terrain.position = vec3(20.0f, 0.0f, 10.0f);
+	terrain.scale = vec3(60.0f, 25.0f, 60.0f);
+	{
+		Measurement m;
+		{
+			Probe probe(m);
+			terrain.LoadFromHeights(hmap);
+		}
+		PrintMeasurement("LoadFromHeights" + suffix, m);
+	}
+
+	//Per-node vertex generation from float and 16-bit samples
+	{
+		vector<QuadTree<TerrainNode>::Iterator> nodes;
+		CollectNodes(terrain.heightmap.Heap(), nodes);
+		vector<vec3> vertices, colors;
+		HeightGrid hmap16(HEIGHT_GRID_UINT16);
+		hmap16.Resize(hmap.GetSize());
+		vector<float> row(size);
+		for (unsigned i = 0; i < size; i++)
+		{
+			hmap.GetRow(i, row.data());
+			hmap16.SetRow(i, row.data());
+		}
+		Measurement m, m16;
+		for (const QuadTree<TerrainNode>::Iterator& node : nodes)
+		{
+			Probe probe(m);
+			terrain.BuildNodeVertices(node, hmap, vertices, colors);
+		}
+		for (const QuadTree<TerrainNode>::Iterator& node : nodes)
+		{
+			Probe probe(m16);
+			terrain.BuildNodeVertices(node, hmap16, vertices, colors);
+		}
+		PrintMeasurement("BuildNodeVertices" + suffix, m);
+		PrintMeasurement("BuildNodeVertices16" + suffix, m16);
+		vector<vec2> morphTargets;
+		Measurement morph;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			Probe probe(morph);
+			terrain.BuildMorphTargets(vertices, morphTargets);
+		}
+		PrintMeasurement("BuildMorphTargets" + suffix, morph);
+	}
+
+	//LOD selection over the camera path
+	{
+		Measurement m;
+		for (const vec3& viewpoint : path)
+		{
+			{
+				Probe probe(m);
+				terrain.Renew(viewpoint);
+			}
+			m.visitedNodes += terrain.GetVisitedNodesCount();
+		}
+		PrintMeasurement("Renew" + suffix, m);
+	}
+
+	//Size of LOD selection for different screen-space error tolerances
+	for (float tolerance : {1.0f, 2.0f, 4.0f, 8.0f})
+	{
+		terrain.pixelTolerance = tolerance;
+		size_t selected = 0;
+		for (const vec3& viewpoint : path)
+		{
+			terrain.Renew(viewpoint);
+			selected += terrain.GetRenderList().size();
+		}
+		printf("%-36s pixel tolerance %.0f: %.1f selected nodes per frame\n",
+			("Renew" + suffix).c_str(), tolerance, static_cast<double>(selected) / path.size());
+	}
+	terrain.pixelTolerance = DEFAULT_PIXEL_TOLERANCE;
+
+	//Incremental LOD selection over the camera path
+	//and building of indirect draw commands for its result
+	{
+		Measurement m, commandsMeasurement;
+		vector<TerrainDrawCommand> commands;
+		for (const vec3& viewpoint : path)
+		{
+			{
+				Probe probe(m);
+				terrain.Update(viewpoint);
+			}
+			m.visitedNodes += terrain.GetVisitedNodesCount();
+			m.reevaluatedNodes += terrain.GetReevaluatedNodesCount();
+			{
+				Probe probe(commandsMeasurement);
+				terrain.BuildDrawCommands(commands);
+			}
+			commandsMeasurement.visitedNodes += commands.size();
+		}
+		PrintMeasurement("Update" + suffix, m);
+		PrintMeasurement("BuildDrawCommands" + suffix, commandsMeasurement);
+	}
+
+	//Draw commands executed on the CPU for terrain uploaded to memory
+	{
+		NullTerrainUploader uploader;
+		Terrain checked(DEFAULT_LOD_RESOLUTION, options.maxLOD);
+		checked.position = terrain.position;
+		checked.scale = terrain.scale;
+		checked.uploader = &uploader;
+		checked.LoadFromHeights(hmap);
+		vector<TerrainDrawCommand> commands;
+		for (size_t i = 0; i < path.size(); i += 10)
+		{
+			checked.Update(path[i]);
+			for (bool sharedVertices : { false, true })
+			{
+				checked.BuildDrawCommands(commands, sharedVertices);
+				CheckDrawCommands("BuildDrawCommands" + suffix, checked, uploader, commands, sharedVertices);
+			}
+		}
+		checked.Unload();
+	}
+
+	//Incremental LOD selection with frustum culling, the camera looks along the path
+	//with 45 degrees field of view. nodes/op is the number of drawn nodes
+	{
+		Measurement m;
+		uint64 selectedNodes = 0, testedNodes = 0;
+		mat4 projection = perspective(45.0f, 16.0f / 9.0f, 0.1f, 10000.0f);
+		for (size_t i = 0; i < path.size(); i++)
+		{
+			//Horizontal direction of flight, looking slightly down
+			vec3 direction = path[(i + 1) % path.size()] - path[i];
+			direction.y = 0.0f;
+			direction = length(direction) > 0.0f ? normalize(direction) : vec3(1.0f, 0.0f, 0.0f);
+			vec3 target = path[i] + direction * 10.0f - vec3(0.0f, 3.0f, 0.0f);
+			terrain.SetFrustum(projection * lookAt(path[i], target, vec3(0.0f, 1.0f, 0.0f)));
+			{
+				Probe probe(m);
+				terrain.Update(path[i]);
+			}
+			const TerrainCullStatistics& statistics = terrain.GetCullStatistics();
+			m.visitedNodes += statistics.drawnNodes;
+			m.reevaluatedNodes += terrain.GetReevaluatedNodesCount();
+			selectedNodes += statistics.selectedNodes;
+			testedNodes += statistics.testedNodes;
+		}
+		terrain.ResetFrustum();
+		PrintMeasurement("CulledUpdate" + suffix, m);
+		double frames = static_cast<double>(std::max<size_t>(path.size(), 1));
+		printf("%-36s drawn %.1f of %.1f selected nodes per frame (%.1f%%), %.1f bounds tests\n",
+			("CulledUpdate" + suffix).c_str(),
+			m.visitedNodes / frames,
+			selectedNodes / frames,
+			selectedNodes ? 100.0 * m.visitedNodes / selectedNodes : 0.0,
+			testedNodes / frames);
+		fflush(stdout);
+	}
+
+	//In-memory terrain with the node cache holding a quarter of nodes,
+	//nodes/op is the number of resident nodes. Frames are paced like streaming ones
+	{
+		Terrain cached(DEFAULT_LOD_RESOLUTION, options.maxLOD);
+		cached.position = terrain.position;
+		cached.scale = terrain.scale;
+		cached.nodeCacheBudget = terrain.heightmap.GetNodes().size() / 4 * terrain.GetNodeVertexBytes();
+		cached.LoadFromHeights(hmap);
+		Measurement m;
+		for (const vec3& viewpoint : path)
+		{
+			{
+				Probe probe(m);
+				cached.Update(viewpoint);
+			}
+			m.visitedNodes += cached.GetResidentNodesCount();
+			m.reevaluatedNodes += cached.GetReevaluatedNodesCount();
+			CheckResidency("CachedUpdate" + suffix, cached);
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		PrintMeasurement("CachedUpdate" + suffix, m);
+		PrintCacheStatistics("CachedUpdate" + suffix, cached);
+		CheckConvergence("CachedUpdate" + suffix, cached, terrain, path.back());
+	}
+
+	//Streaming over the camera path, nodes/op is the number of resident nodes.
+	//Frames are paced, so the reading thread has time to load nodes
+	{
+		const string filename = "benchmark_pyramid.lodp";
+		Measurement saveMeasurement;
+		bool saved;
+		{
+			Probe probe(saveMeasurement);
+			saved = terrain.SaveStream(filename, hmap);
+		}
+		if (!saved)
+		{
+			printf("%-36s skipped: can't write pyramid file\n", ("StreamUpdate" + suffix).c_str());
+			return;
+		}
+		PrintMeasurement("SaveStream" + suffix, saveMeasurement);
+
+		Terrain streamed;
+		streamed.position = terrain.position;
+		streamed.scale = terrain.scale;
+		size_t nodeBytes = terrain.GetNodeVertexBytes();
+		Measurement openMeasurement;
+		{
+			Probe probe(openMeasurement);
+			streamed.OpenStream(filename, terrain.heightmap.GetNodes().size() / 4 * nodeBytes);
+		}
+		PrintMeasurement("OpenStream" + suffix, openMeasurement);
+		Measurement m;
+		for (const vec3& viewpoint : path)
+		{
+			{
+				Probe probe(m);
+				streamed.Update(viewpoint);
+			}
+			m.visitedNodes += streamed.GetResidentNodesCount();
+			m.reevaluatedNodes += streamed.GetReevaluatedNodesCount();
+			CheckResidency("StreamUpdate" + suffix, streamed);
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		PrintMeasurement("StreamUpdate" + suffix, m);
+		PrintCacheStatistics("StreamUpdate" + suffix, streamed);
+		CheckConvergence("StreamUpdate" + suffix, streamed, terrain, path.back());
+		streamed.Unload();
+		remove(filename.c_str());
+	}
+}
+
+//Average ACMR of the sixteen sets of indices
+float AverageACMR(const Terrain& terrain, int cacheSize)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < 16; i++)
+		sum += terrain.GetIndicesACMR(i, cacheSize);
+	return sum / 16;
+}
+
+void BenchmarkIndices(const BenchmarkOptions& options)
+{
+	const int repetitions = 50;
+	const int cacheSizes[] = { 16, VERTEX_CACHE_SIZE };
+	for (int lodRes : options.lodResolutions)
+	{
+		Terrain terrain(lodRes, options.maxLOD);
+		float rowOrderACMR[2];
+		for (bool optimize : { false, true })
+		{
+			terrain.optimizeIndices = optimize;
+			Measurement m;
+			for (int i = 0; i < repetitions; i++)
+			{
+				Probe probe(m);
+				terrain.GenerateIndices();
+			}
+			PrintMeasurement((optimize ? "GenerateIndices/" : "GenerateIndicesRowOrder/") + ToString(lodRes), m);
+			if (!optimize)
+			{
+				for (int c = 0; c < 2; c++)
+					rowOrderACMR[c] = AverageACMR(terrain, cacheSizes[c]);
+				continue;
+			}
+			for (int c = 0; c < 2; c++)
+				printf("%-36s %d-bit indices, FIFO %d ACMR: row order %.3f, optimized %.3f\n",
+					("IndicesACMR/" + ToString(lodRes)).c_str(), terrain.GetIndexSize() * 8,
+					cacheSizes[c], rowOrderACMR[c], AverageACMR(terrain, cacheSizes[c]));
+			printf("%-36s FIFO %d ACMR of variants:", ("IndicesACMR/" + ToString(lodRes)).c_str(), VERTEX_CACHE_SIZE);
+			for (int i = 0; i < 16; i++)
+				printf(" %.3f", terrain.GetIndicesACMR(i, VERTEX_CACHE_SIZE));
+			printf("\n");
+		}
+	}
+}
+
+void BenchmarkLoading(unsigned size)
+{
+	const int repetitions = 3;
+	const string filename = "benchmark_heightmap.tga";
+
+	HeightGrid hmap;
+	GenerateHeightmap(hmap, size);
+	if (!WriteHeightmapTGA(filename, hmap))
+	{
+		printf("%-36s skipped: can't write TGA file\n", ("Image::Load/" + ToString(size)).c_str());
+		return;
+	}
+	hmap.Clear();
+
+	Measurement m;
+	for (int i = 0; i < repetitions; i++)
+	{
+		Image loaded;
+		Probe probe(m);
+		loaded.Load(filename);
+	}
+	Measurement heightsMeasurement;
+	for (int i = 0; i < repetitions; i++)
+	{
+		HeightGrid heights(HEIGHT_GRID_UINT16);
+		Probe probe(heightsMeasurement);
+		TGAFile file;
+		file.Open(filename);
+		file.ReadHeights(heights);
+	}
+	remove(filename.c_str());
+	PrintMeasurement("Image::Load/" + ToString(size), m);
+	PrintMeasurement("TGAFile::ReadHeights/" + ToString(size), heightsMeasurement);
+}
+
+template<typename T>
+vector<T> ParseList(const char* str)
+{
+	vector<T> list;
+	istringstream sin(str);
+	string item;
+	while (getline(sin, item, ','))
+		list.push_back(static_cast<T>(atoi(item.c_str())));
+	return list;
+}
+
+int main(int argc, char* argv[])
+{
+	ChangeLog("LODTerrainBenchmark.log");
+
+	BenchmarkOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--sizes" && hasValue)
+			options.sizes = ParseList<unsigned>(argv[++i]);
+		else if (arg == "--lod-res" && hasValue)
+			options.lodResolutions = ParseList<int>(argv[++i]);
+		else if (arg == "--max-lod" && hasValue)
+			options.maxLOD = atoi(argv[++i]);
+		else if (arg == "--path" && hasValue)
+			options.pathFile = argv[++i];
+		else if (arg == "--frames" && hasValue)
+			options.frames = atoi(argv[++i]);
+		else if (arg == "--no-load")
+			options.benchmarkLoading = false;
+		else
+		{
+			fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	vector<vec3> path;
+	if (!options.pathFile.empty())
+	{
+		if (!LoadCameraPath(options.pathFile, path))
+		{
+			fprintf(stderr, "Can't load camera path from %s\n", options.pathFile.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	else
+		path = GenerateCameraPath(options.frames);
+
+	printf("maxLOD = %d, camera path: %u viewpoints\n\n", options.maxLOD, static_cast<unsigned>(path.size()));
+	CheckVertexCache();
+	CheckRingAllocator();
+	PrintHeader();
+	BenchmarkIndices(options);
+	for (unsigned size : options.sizes)
+	{
+		BenchmarkTerrain(options, path, size);
+		if (options.benchmarkLoading)
+			BenchmarkLoading(size);
+	}
+	if (g_FailedChecks > 0)
+	{
+		printf("\n%d checks failed\n", g_FailedChecks);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
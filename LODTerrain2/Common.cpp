@@ -1,7 +1,5 @@
 #include "Common.h"
 
-GLenum g_OpenGLError = GL_NO_ERROR;
-
 const int LOGGER_FILENAME_MAX              = 256;
 char g_LoggerFileName[LOGGER_FILENAME_MAX] = "log.txt";
 
@@ -111,30 +109,3 @@ bool LoadFile(const char *fileName, bool binary, uint8_t **buffer, uint32_t *siz
 
 	return true;
 }
-
-void OpenGLPrintDebugInfo()
-{
-	// OpenGL context info
-	GLint major, minor;
-	glGetIntegerv(GL_MAJOR_VERSION, &major);
-	glGetIntegerv(GL_MINOR_VERSION, &minor);
-	WriteToLog("OpenGL render context information:\n"
-		"  Renderer       : %s\n"
-		"  Vendor         : %s\n"
-		"  Version        : %s\n"
-		"  GLSL version   : %s\n"
-		"  OpenGL version : %d.%d\n",
-		(const char*)glGetString(GL_RENDERER),
-		(const char*)glGetString(GL_VENDOR),
-		(const char*)glGetString(GL_VERSION),
-		(const char*)glGetString(GL_SHADING_LANGUAGE_VERSION),
-		major, minor
-	);
-
-	// Important OpenGL parameters
-	OPENGL_INT_PRINT_DEBUG(GL_MAX_VERTEX_ATTRIBS);
-	OPENGL_INT_PRINT_DEBUG(GL_MAX_TEXTURE_IMAGE_UNITS);
-
-	OPENGL_CHECK_FOR_ERRORS();
-}
-
@@ -1,5 +1,6 @@
 //
 //This header contains the most common definitions used in the project
+//OpenGL-related definitions live in GLCommon.h, so this header has no GL dependencies
 //
 
 #ifndef COMMON_H
@@ -7,26 +8,23 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
-// OpenGL headers
-#define GLEW_STATIC 
-#include "GL/glew.h"
-#include "GLFW/glfw3.h"
-
 // Standart C headers
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
+#include <cstdint>
+#include <cfloat>
 #include <cmath>
 #include <ctime>
+#include <cassert>
 
 #include <sstream>
+#include <string>
+#include <stdexcept>
+#include <memory>
 
-#if defined(_MSC_VER)
+#if defined(_MSC_VER) && _MSC_VER < 1900
 #define snprintf _snprintf
-#elif defined(__MINGW32__)
-#include <stdint.h>
-#else
-#error You must compile this code with MSVC or MinGW!
 #endif
 
 // OpenGL math extensions
@@ -34,8 +32,8 @@
 //  - linear algebra functions
 //  - vector types and vector arithmetic
 //  - matrices and their transformations
-#include "glm\glm.hpp"
-#include "glm\ext.hpp"
+#include "glm/glm.hpp"
+#include "glm/ext.hpp"
 
 // Using STL and GLM namespaces
 using namespace std;
@@ -54,9 +52,6 @@ void ChangeLog(const char *fileName);
 // Write to current log file
 void WriteToLog(const char *format, ...);
 
-// Global variable for OpenGL error storage
-extern GLenum g_OpenGLError;
-
 // Get current time
 unsigned int GetTime();
 
@@ -70,39 +65,4 @@ string ToString(T val)
 }
 
 
-
-// Print debug info
-#define OPENGL_INT_PRINT_DEBUG(name) \
-	GLint info_ ## name; \
-	glGetIntegerv(name, &info_ ## name); \
-	WriteToLog(#name " = %d\n", info_ ## name);
-
-// Safety call of GetProc
-#define OPENGL_GET_PROC(p,n) \
-	n = (p)wglGetProcAddress(#n); \
-	if (NULL == n) \
-	{ \
-		WriteToLog("ERROR: Loading extension '%s' fail (%d)\n", #n, GetLastError()); \
-		return false; \
-	}
-
-// Check for OpenGL errors
-#define OPENGL_CHECK_FOR_ERRORS() \
-	if ((g_OpenGLError = glGetError()) != GL_NO_ERROR) \
-		WriteToLog("ERROR: OpenGL error %d\n", (int)g_OpenGLError);
-
-// Safety call of OpenGL function
-#define OPENGL_CALL(expression) \
-	{ \
-		expression; \
-		if ((g_OpenGLError = glGetError()) != GL_NO_ERROR) \
-			WriteToLog("ERROR: OpenGL expression \"" #expression "\" error %d\n", (int)g_OpenGLError); \
-	}
-
-// Initialization of neccesary OpenGL extentios
-bool OpenGLInitExtensions();
-
-// Print to log the info about OpenGL version and state
-void OpenGLPrintDebugInfo();
-
 #endif // COMMON_H
\ No newline at end of file
@@ -1,18 +1,24 @@
 #ifndef DENSE_QUAD_TREE_H
 #define DENSE_QUAD_TREE_H
 
-#include <memory>
+#include <vector>
 #include "Common.h"
-#include "Array2d.h"
 
 #define QTREE_CHILDREN_COUNT 4
 #define QTREE_NEIGHBOURS_COUNT 4
 
+//
+//Linear quadtree
+//All nodes of a complete tree are stored in a single array without any links:
+//layers follow each other starting from the heap, nodes of a layer are stored in
+//Morton (Z-curve) order, so four children of a node are adjacent in memory.
+//Children, neighbours and parent are computed from the node position.
+//
 template<typename T>
 class QuadTree
 {
 private:
-    template <typename Ptr>
+    template <typename Ptr, typename Ref>
     struct TemplateIterator
     {
     public:
@@ -23,21 +29,24 @@ private:
             return
                 obj == op.obj &&
                 level == op.level &&
-                coord = op.coord;
+                coord == op.coord;
         }
-        T* operator->() const
+        Ref* operator->() const
         {
-            if (!operator bool()) throw std::exception("Iterator is not dereferencable.");
-            return obj->layers[level][coord].get();
+            if (!operator bool()) throw logic_error("Iterator is not dereferencable.");
+            return &obj->nodes[Index()];
+        }
+        Ref& operator*() const
+        {
+            return *operator->();
         }
         operator bool() const
         {
             return
                 (obj != nullptr) &&
                 (level < obj->GetHeight()) && (level >= 0) &&
-                (coord.x < obj->layers[level].GetSize().x) &&
-                (coord.y < obj->layers[level].GetSize().y) &&
-                (obj->layers[level][coord]);
+                (coord.x < static_cast<unsigned>(LayerSize())) &&
+                (coord.y < static_cast<unsigned>(LayerSize()));
         }
 
         //Get access to children, neighbours or parent
@@ -75,36 +84,30 @@ private:
         }
         TemplateIterator Parent() const
         {
-            return Iterator(obj, level - 1, uvec2(coord.x / 2, coord.y / 2));
+            return TemplateIterator(obj, level - 1, uvec2(coord.x / 2, coord.y / 2));
         }
 
-        //Add or remove child
+        //Set data of the child, tree grows by one layer if neccessary
         TemplateIterator Add(int index, const T& data = T()) const
         {
             assert(index >= 0 || index < QTREE_CHILDREN_COUNT);
             if (!operator bool())
-                throw std::exception("Iterator is not dereferencable.");
+                throw logic_error("Iterator is not dereferencable.");
 
             if (level + 1 == obj->GetHeight()) obj->AddLayer();
 
-            uvec2 newOffset = ChildOffset(index);
-            obj->layers[level + 1][newOffset] = unique_ptr<T>(new T(data));
-            return Iterator(obj, level + 1, newOffset);
-        }
-        void Remove() const
-        {
-            if (!operator bool())
-                return;
-            for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
-                Child(i).Remove();
-            delete obj->layers[level][coord].reset(nullptr);
+            TemplateIterator child = Child(index);
+            *child = data;
+            return child;
         }
 
         //Get current node parameters
         int Level()     const { return level; }
-        int LayerSize() const { return pow(2, level); }
+        int LayerSize() const { return 1 << level; }
         uvec2 Offset()  const { return coord; }
         vec2 OffsetFloat() const { return static_cast<vec2>(coord) / static_cast<float>(LayerSize()); }
+        //Position of the node in the linear storage
+        size_t Index()  const { return LayerStart(level) + MortonCode(coord); }
 
     private:
         TemplateIterator(Ptr obj = nullptr, int level = 0, uvec2 coord = uvec2(0)) :
@@ -116,26 +119,69 @@ private:
 
 public:
 	// Constructor
-	QuadTree(const T& initdata = T())
-	{ 
+	QuadTree(const T& initdata = T()) : height(0)
+	{
 		AddLayer();
-		layers[0][uvec2(0)] = make_unique<T>(initdata);
+		nodes[0] = initdata;
 	};
 	// Destructor
 	~QuadTree() { };
 
+	// Make complete tree of given height filled with data
+	void Reset(int newHeight, const T& data = T())
+	{
+		if (newHeight < 1)
+			throw invalid_argument("Invalid height. It must be 1 or higher.");
+		height = newHeight;
+		nodes.assign(LayerStart(height), data);
+	}
+
 	// Get tree height
-	int GetHeight() const { return layers.size(); }
+	int GetHeight() const { return height; }
 
     // Iterators
-    typedef TemplateIterator<QuadTree*> Iterator;
-    typedef TemplateIterator<const QuadTree*> ConstIterator;
+    typedef TemplateIterator<QuadTree*, T> Iterator;
+    typedef TemplateIterator<const QuadTree*, const T> ConstIterator;
 
     // Get heap
 	Iterator Heap() { return Iterator(this); }
+	ConstIterator Heap() const { return ConstIterator(this); }
+
+	// Get node by its position in the storage
+	Iterator Node(size_t index) { return Iterator(this, IndexLevel(index), IndexOffset(index)); }
+	ConstIterator Node(size_t index) const { return ConstIterator(this, IndexLevel(index), IndexOffset(index)); }
+
+	// Get all nodes in storage order
+	// (every node goes after its parent, so the order is valid for top-down passes)
+	vector<T>& GetNodes() { return nodes; }
+	const vector<T>& GetNodes() const { return nodes; }
+
+	// Index of the first node of the layer in the storage
+	static size_t LayerStart(int level)
+	{
+		return ((size_t(1) << (2 * level)) - 1) / 3;
+	}
+	// Index of the node in the layer: interleaved bits of its coordinates
+	static size_t MortonCode(uvec2 coord)
+	{
+		return SpreadBits(coord.x) | (SpreadBits(coord.y) << 1);
+	}
+	// Coordinates of the node in the layer by its Morton code
+	static uvec2 MortonDecode(size_t code)
+	{
+		return uvec2(CompactBits(code), CompactBits(code >> 1));
+	}
+	// Layer containing the node with given storage index
+	static int IndexLevel(size_t index)
+	{
+		int level = 0;
+		while (LayerStart(level + 1) <= index)
+			level++;
+		return level;
+	}
 
     // Iteration directions
-    //   N  
+    //   N
     // W o E
     //   S
     static const int north = 3;
@@ -153,14 +199,37 @@ public:
 private:
 	QuadTree(const QuadTree<T>& a);
 	QuadTree& operator=(const QuadTree<T>&);
-	vector<Array2D<unique_ptr<T>>> layers;
+	vector<T> nodes;
+	int height;
 	void AddLayer()
 	{
-		layers.push_back(Array2D<unique_ptr<T>>(
-            uvec2(pow(2, layers.size())))
-            );
+		height++;
+		nodes.resize(LayerStart(height));
+	}
+	// Insert a zero bit after each of the lower 16 bits
+	static size_t SpreadBits(size_t x)
+	{
+		x &= 0xFFFF;
+		x = (x | (x << 8)) & 0x00FF00FF;
+		x = (x | (x << 4)) & 0x0F0F0F0F;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	}
+	// Inverse of SpreadBits: gather even bits
+	static unsigned CompactBits(size_t x)
+	{
+		x &= 0x55555555;
+		x = (x | (x >> 1)) & 0x33333333;
+		x = (x | (x >> 2)) & 0x0F0F0F0F;
+		x = (x | (x >> 4)) & 0x00FF00FF;
+		x = (x | (x >> 8)) & 0x0000FFFF;
+		return static_cast<unsigned>(x);
+	}
+	static uvec2 IndexOffset(size_t index)
+	{
+		return MortonDecode(index - LayerStart(IndexLevel(index)));
 	}
 };
 
 #endif // DENSE_QUAD_TREE_H
-
@@ -0,0 +1,30 @@
+#include "GLCommon.h"
+
+GLenum g_OpenGLError = GL_NO_ERROR;
+
+void OpenGLPrintDebugInfo()
+{
+	// OpenGL context info
+	GLint major, minor;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	WriteToLog("OpenGL render context information:\n"
+		"  Renderer       : %s\n"
+		"  Vendor         : %s\n"
+		"  Version        : %s\n"
+		"  GLSL version   : %s\n"
+		"  OpenGL version : %d.%d\n",
+		(const char*)glGetString(GL_RENDERER),
+		(const char*)glGetString(GL_VENDOR),
+		(const char*)glGetString(GL_VERSION),
+		(const char*)glGetString(GL_SHADING_LANGUAGE_VERSION),
+		major, minor
+	);
+
+	// Important OpenGL parameters
+	OPENGL_INT_PRINT_DEBUG(GL_MAX_VERTEX_ATTRIBS);
+	OPENGL_INT_PRINT_DEBUG(GL_MAX_TEXTURE_IMAGE_UNITS);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
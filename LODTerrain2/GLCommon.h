@@ -0,0 +1,52 @@
+//
+//This header contains OpenGL definitions used by the renderer part of the project
+//
+
+#ifndef GLCOMMON_H
+#define GLCOMMON_H
+
+// OpenGL headers
+#define GLEW_STATIC 
+#include "GL/glew.h"
+#include "GLFW/glfw3.h"
+
+#include "Common.h"
+
+// Global variable for OpenGL error storage
+extern GLenum g_OpenGLError;
+
+// Print debug info
+#define OPENGL_INT_PRINT_DEBUG(name) \
+	GLint info_ ## name; \
+	glGetIntegerv(name, &info_ ## name); \
+	WriteToLog(#name " = %d\n", info_ ## name);
+
+// Safety call of GetProc
+#define OPENGL_GET_PROC(p,n) \
+	n = (p)wglGetProcAddress(#n); \
+	if (NULL == n) \
+	{ \
+		WriteToLog("ERROR: Loading extension '%s' fail (%d)\n", #n, GetLastError()); \
+		return false; \
+	}
+
+// Check for OpenGL errors
+#define OPENGL_CHECK_FOR_ERRORS() \
+	if ((g_OpenGLError = glGetError()) != GL_NO_ERROR) \
+		WriteToLog("ERROR: OpenGL error %d\n", (int)g_OpenGLError);
+
+// Safety call of OpenGL function
+#define OPENGL_CALL(expression) \
+	{ \
+		expression; \
+		if ((g_OpenGLError = glGetError()) != GL_NO_ERROR) \
+			WriteToLog("ERROR: OpenGL expression \"" #expression "\" error %d\n", (int)g_OpenGLError); \
+	}
+
+// Initialization of neccesary OpenGL extentios
+bool OpenGLInitExtensions();
+
+// Print to log the info about OpenGL version and state
+void OpenGLPrintDebugInfo();
+
+#endif // GLCOMMON_H
@@ -0,0 +1,463 @@
+#include "GLTerrainUploader.h"
+#include "HeightGrid.h"
+#include <cstddef>
+
+//Store data to the buffer, reallocating it if it is too small
+static void UpdateBuffer(GLenum target, size_t& capacity, size_t size, const void* data)
+{
+	if (size > capacity)
+	{
+		glBufferData(target, size, data, GL_STREAM_DRAW);
+		capacity = size;
+	}
+	else
+		glBufferSubData(target, 0, size, data);
+}
+
+void GLTerrainUploader::UploadIndices(const void* indices, size_t count, size_t indexSize)
+{
+	this->indexSize = indexSize;
+	indexType = indexSize == sizeof(GLushort) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	glGenBuffers(1, &indicesBufferID);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesBufferID);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * indexSize, indices, GL_STATIC_DRAW);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLTerrainUploader::UnloadIndices()
+{
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glDeleteBuffers(1, &indicesBufferID);
+	indicesBufferID = 0;
+}
+
+void GLTerrainUploader::ReleasePool()
+{
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	for (NodeBuffers& buffers : freeBuffers)
+	{
+		glDeleteBuffers(3, buffers.vboID);
+		glDeleteVertexArrays(1, &buffers.vaoID);
+		vertexMemoryUsage -= 2 * nodeBufferSize + morphBufferSize;
+	}
+	freeBuffers.clear();
+}
+
+void GLTerrainUploader::Release()
+{
+	ReleasePool();
+	uploadRing.Destroy();
+	uploadRingChecked = false;
+	vertexMemoryUsage = 0;
+}
+
+void GLTerrainUploader::FlushUploads()
+{
+	uploadRing.Flush();
+}
+
+void GLTerrainUploader::CopyToBuffer(GLuint buffer, GLintptr offset, const void* data, size_t size)
+{
+	if (!uploadRingChecked)
+	{
+		if (uploadRing.Create())
+			WriteToLog("OK: Node vertices are uploaded through persistently mapped ring buffer\n");
+		uploadRingChecked = true;
+	}
+	if (uploadRing.Upload(buffer, offset, data, size))
+		return;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+}
+
+void GLTerrainUploader::UploadNode(
+	size_t /*index*/,
+	TerrainNode& node,
+	const vector<vec3>& vertices,
+	const vector<vec3>& colors,
+	const vector<vec2>& morphTargets
+	)
+{
+	size_t size = vertices.size() * 3 * sizeof(GLfloat);
+	size_t morphSize = morphTargets.size() * 2 * sizeof(GLfloat);
+	if (size != nodeBufferSize || morphSize != morphBufferSize)
+	{
+		ReleasePool();
+		nodeBufferSize = size;
+		morphBufferSize = morphSize;
+	}
+	if (!freeBuffers.empty())
+	{
+		// reuse buffers of an unloaded node, VAO setup is kept
+		NodeBuffers& buffers = freeBuffers.back();
+		node.vaoID = buffers.vaoID;
+		for (int i = 0; i < 3; i++)
+			node.vboID[i] = buffers.vboID[i];
+		freeBuffers.pop_back();
+		CopyToBuffer(node.vboID[0], 0, vertices.data(), size);
+		CopyToBuffer(node.vboID[1], 0, colors.data(), size);
+		CopyToBuffer(node.vboID[2], 0, morphTargets.data(), morphSize);
+
+		OPENGL_CHECK_FOR_ERRORS();
+		return;
+	}
+
+	// VAO allocation
+	glGenVertexArrays(1, &node.vaoID);
+	// VAO setup
+	glBindVertexArray(node.vaoID);
+	// VBOs allocation
+	glGenBuffers(3, node.vboID);
+	// VBOs setup
+	// vertices buffer
+	glBindBuffer(GL_ARRAY_BUFFER, node.vboID[0]);
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(0);
+	// colors buffer
+	glBindBuffer(GL_ARRAY_BUFFER, node.vboID[1]);
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(1);
+	// morph targets buffer
+	glBindBuffer(GL_ARRAY_BUFFER, node.vboID[2]);
+	glBufferData(GL_ARRAY_BUFFER, morphSize, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(2);
+	// indices buffer
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesBufferID);
+	vertexMemoryUsage += 2 * size + morphSize;
+	// data goes through the staging ring
+	CopyToBuffer(node.vboID[0], 0, vertices.data(), size);
+	CopyToBuffer(node.vboID[1], 0, colors.data(), size);
+	CopyToBuffer(node.vboID[2], 0, morphTargets.data(), morphSize);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLTerrainUploader::UnloadNode(TerrainNode& node)
+{
+	if (node.vaoID)
+	{
+		// buffers are returned to the pool
+		NodeBuffers buffers;
+		buffers.vaoID = node.vaoID;
+		for (int i = 0; i < 3; i++)
+			buffers.vboID[i] = node.vboID[i];
+		freeBuffers.push_back(buffers);
+		node.vaoID = 0;
+	}
+}
+
+void GLBatchedTerrainUploader::Reserve(size_t nodesCount, size_t verticesCount)
+{
+	verticesPerNode = verticesCount;
+	GLsizeiptr size = nodesCount * verticesPerNode * 3 * sizeof(GLfloat);
+	GLsizeiptr morphSize = nodesCount * verticesPerNode * 2 * sizeof(GLfloat);
+
+	glGenVertexArrays(1, &vaoID);
+	glBindVertexArray(vaoID);
+	glGenBuffers(3, vboID);
+	// vertices buffer
+	glBindBuffer(GL_ARRAY_BUFFER, vboID[0]);
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(0);
+	// colors buffer
+	glBindBuffer(GL_ARRAY_BUFFER, vboID[1]);
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(1);
+	// morph targets buffer
+	glBindBuffer(GL_ARRAY_BUFFER, vboID[2]);
+	glBufferData(GL_ARRAY_BUFFER, morphSize, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(2);
+	// morphs buffer: factors of the node and its edges
+	glGenBuffers(1, &morphsBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, morphsBufferID);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(TerrainNodeMorph), 0);
+	glVertexAttribDivisor(3, 1);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(TerrainNodeMorph),
+		reinterpret_cast<const GLvoid*>(offsetof(TerrainNodeMorph, edges)));
+	glVertexAttribDivisor(4, 1);
+	glEnableVertexAttribArray(4);
+	// indices buffer
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, GetIndicesBufferID());
+	// draw commands buffer
+	glGenBuffers(1, &commandsBufferID);
+	morphsBufferSize = commandsBufferSize = 0;
+	vertexMemoryUsage = 2 * size + morphSize;
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLBatchedTerrainUploader::Release()
+{
+	if (vaoID)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glDeleteBuffers(3, vboID);
+		glDeleteBuffers(1, &morphsBufferID);
+		glDeleteBuffers(1, &commandsBufferID);
+		glBindVertexArray(0);
+		glDeleteVertexArrays(1, &vaoID);
+		vaoID = morphsBufferID = commandsBufferID = 0;
+	}
+	GLTerrainUploader::Release();
+}
+
+void GLBatchedTerrainUploader::UploadNode(
+	size_t index,
+	TerrainNode& node,
+	const vector<vec3>& vertices,
+	const vector<vec3>& colors,
+	const vector<vec2>& morphTargets
+	)
+{
+	GLintptr offset = index * verticesPerNode * 3 * sizeof(GLfloat);
+	CopyToBuffer(vboID[0], offset, vertices.data(), vertices.size() * 3 * sizeof(GLfloat));
+	CopyToBuffer(vboID[1], offset, colors.data(), colors.size() * 3 * sizeof(GLfloat));
+	GLintptr morphOffset = index * verticesPerNode * 2 * sizeof(GLfloat);
+	CopyToBuffer(vboID[2], morphOffset, morphTargets.data(), morphTargets.size() * 2 * sizeof(GLfloat));
+	node.vaoID = vaoID;
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLBatchedTerrainUploader::UnloadNode(TerrainNode& node)
+{
+	//Node data is released together with the shared buffers
+	node.vaoID = 0;
+}
+
+void GLBatchedTerrainUploader::Draw(const vector<TerrainDrawCommand>& commands, const vector<TerrainNodeMorph>& morphs)
+{
+	if (commands.empty())
+		return;
+	glBindVertexArray(vaoID);
+	glBindBuffer(GL_ARRAY_BUFFER, morphsBufferID);
+	UpdateBuffer(GL_ARRAY_BUFFER, morphsBufferSize, morphs.size() * sizeof(TerrainNodeMorph), morphs.data());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferID);
+	UpdateBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferSize, commands.size() * sizeof(TerrainDrawCommand), commands.data());
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GetIndexType(), nullptr, static_cast<GLsizei>(commands.size()), 0);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+bool GLHeightmapTerrainUploader::IsHeightmapSupported(uvec2 heightmapSize)
+{
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	return
+		heightmapSize.x <= static_cast<unsigned>(maxTextureSize) &&
+		heightmapSize.y <= static_cast<unsigned>(maxTextureSize);
+}
+
+void GLHeightmapTerrainUploader::UploadHeightmap(const HeightGrid& hmap, int lodResolution)
+{
+	if (!IsHeightmapSupported(hmap.GetSize()))
+	{
+		WriteToLog("ERROR: Heightmap of %ux%u samples exceeds GL_MAX_TEXTURE_SIZE\n", hmap.GetSize().x, hmap.GetSize().y);
+		return;
+	}
+	// heightmap texture: rows of the grid go along texture height,
+	// samples are uploaded as they are stored, skipping padding of rows
+	uvec2 size = hmap.GetSize();
+	GLint internalFormat = GL_R32F;
+	GLenum type = GL_FLOAT;
+	if (hmap.GetFormat() == HEIGHT_GRID_UINT16)
+	{
+		internalFormat = GL_R16;
+		type = GL_UNSIGNED_SHORT;
+	}
+	else if (hmap.GetFormat() == HEIGHT_GRID_HALF)
+	{
+		internalFormat = GL_R16F;
+		type = GL_HALF_FLOAT;
+	}
+	glGenTextures(1, &heightmapTextureID);
+	glActiveTexture(GL_TEXTURE0 + heightmapUnit);
+	glBindTexture(GL_TEXTURE_2D, heightmapTextureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(hmap.GetStride()));
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size.x, size.y, 0, GL_RED, type, hmap.GetData());
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	// grid shared by all nodes, its vertices are ordered like vertices of a node
+	vector<vec2> grid;
+	grid.reserve((lodResolution + 1) * (lodResolution + 1));
+	for (int i = 0; i <= lodResolution; i++)
+	for (int j = 0; j <= lodResolution; j++)
+		grid.push_back(vec2(i, j) / static_cast<float>(lodResolution));
+
+	glGenVertexArrays(1, &vaoID);
+	glBindVertexArray(vaoID);
+	// grid buffer
+	glGenBuffers(1, &gridBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, gridBufferID);
+	glBufferData(GL_ARRAY_BUFFER, grid.size() * 2 * sizeof(GLfloat), grid.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
+	glEnableVertexAttribArray(0);
+	// instances buffer: offset and size of the node
+	glGenBuffers(1, &instancesBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, instancesBufferID);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glVertexAttribDivisor(2, 1);
+	glEnableVertexAttribArray(2);
+	// morphs buffer: factors of the node and its edges
+	glGenBuffers(1, &morphsBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, morphsBufferID);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(TerrainNodeMorph), 0);
+	glVertexAttribDivisor(3, 1);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(TerrainNodeMorph),
+		reinterpret_cast<const GLvoid*>(offsetof(TerrainNodeMorph, edges)));
+	glVertexAttribDivisor(4, 1);
+	glEnableVertexAttribArray(4);
+	// indices buffer
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, GetIndicesBufferID());
+	// draw commands buffer
+	glGenBuffers(1, &commandsBufferID);
+	instancesBufferSize = morphsBufferSize = commandsBufferSize = 0;
+	vertexMemoryUsage = static_cast<size_t>(size.x) * size.y * hmap.GetBytesPerSample() + grid.size() * 2 * sizeof(GLfloat);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLHeightmapTerrainUploader::Release()
+{
+	if (vaoID)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glDeleteBuffers(1, &gridBufferID);
+		glDeleteBuffers(1, &instancesBufferID);
+		glDeleteBuffers(1, &morphsBufferID);
+		glDeleteBuffers(1, &commandsBufferID);
+		glBindVertexArray(0);
+		glDeleteVertexArrays(1, &vaoID);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDeleteTextures(1, &heightmapTextureID);
+		vaoID = gridBufferID = instancesBufferID = morphsBufferID = commandsBufferID = heightmapTextureID = 0;
+	}
+	GLTerrainUploader::Release();
+}
+
+void GLHeightmapTerrainUploader::Draw(
+	const vector<TerrainDrawCommand>& commands,
+	const vector<vec3>& instances,
+	const vector<TerrainNodeMorph>& morphs
+	)
+{
+	if (commands.empty())
+		return;
+	glBindVertexArray(vaoID);
+	glActiveTexture(GL_TEXTURE0 + heightmapUnit);
+	glBindTexture(GL_TEXTURE_2D, heightmapTextureID);
+	glBindBuffer(GL_ARRAY_BUFFER, instancesBufferID);
+	UpdateBuffer(GL_ARRAY_BUFFER, instancesBufferSize, instances.size() * sizeof(vec3), instances.data());
+	glBindBuffer(GL_ARRAY_BUFFER, morphsBufferID);
+	UpdateBuffer(GL_ARRAY_BUFFER, morphsBufferSize, morphs.size() * sizeof(TerrainNodeMorph), morphs.data());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferID);
+	UpdateBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferSize, commands.size() * sizeof(TerrainDrawCommand), commands.data());
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GetIndexType(), nullptr, static_cast<GLsizei>(commands.size()), 0);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLCompactTerrainUploader::Reserve(size_t nodesCount, size_t verticesCount)
+{
+	verticesPerNode = verticesCount;
+	GLsizeiptr size = nodesCount * verticesPerNode * sizeof(GLushort);
+
+	glGenVertexArrays(1, &vaoID);
+	glBindVertexArray(vaoID);
+	// heights buffer
+	glGenBuffers(1, &heightsBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, heightsBufferID);
+	glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(GLushort), 0);
+	glEnableVertexAttribArray(0);
+	// instances buffer: offset and size of the node
+	glGenBuffers(1, &instancesBufferID);
+	glBindBuffer(GL_ARRAY_BUFFER, instancesBufferID);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
+	glVertexAttribDivisor(2, 1);
+	glEnableVertexAttribArray(2);
+	// indices buffer
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, GetIndicesBufferID());
+	// draw commands buffer
+	glGenBuffers(1, &commandsBufferID);
+	instancesBufferSize = commandsBufferSize = 0;
+	vertexMemoryUsage = size;
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLCompactTerrainUploader::Release()
+{
+	if (vaoID)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glDeleteBuffers(1, &heightsBufferID);
+		glDeleteBuffers(1, &instancesBufferID);
+		glDeleteBuffers(1, &commandsBufferID);
+		glBindVertexArray(0);
+		glDeleteVertexArrays(1, &vaoID);
+		vaoID = heightsBufferID = instancesBufferID = commandsBufferID = 0;
+	}
+	GLTerrainUploader::Release();
+}
+
+void GLCompactTerrainUploader::UploadNode(
+	size_t index,
+	TerrainNode& node,
+	const vector<vec3>& vertices,
+	const vector<vec3>& /*colors*/,
+	const vector<vec2>& /*morphTargets*/
+	)
+{
+	// heights are normalized, so 16-bit fixed point keeps more precision than half float
+	packedHeights.resize((vertices.size() + 1) / 2);
+	for (size_t i = 0; i < packedHeights.size(); i++)
+	{
+		float second = 2 * i + 1 < vertices.size() ? vertices[2 * i + 1].y : 0.0f;
+		packedHeights[i] = packUnorm2x16(vec2(vertices[2 * i].y, second));
+	}
+	GLintptr offset = index * verticesPerNode * sizeof(GLushort);
+	CopyToBuffer(heightsBufferID, offset, packedHeights.data(), vertices.size() * sizeof(GLushort));
+	node.vaoID = vaoID;
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
+
+void GLCompactTerrainUploader::UnloadNode(TerrainNode& node)
+{
+	//Node data is released together with the shared buffers
+	node.vaoID = 0;
+}
+
+void GLCompactTerrainUploader::Draw(const vector<TerrainDrawCommand>& commands, const vector<vec3>& instances)
+{
+	if (commands.empty())
+		return;
+	glBindVertexArray(vaoID);
+	glBindBuffer(GL_ARRAY_BUFFER, instancesBufferID);
+	UpdateBuffer(GL_ARRAY_BUFFER, instancesBufferSize, instances.size() * sizeof(vec3), instances.data());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferID);
+	UpdateBuffer(GL_DRAW_INDIRECT_BUFFER, commandsBufferSize, commands.size() * sizeof(TerrainDrawCommand), commands.data());
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GetIndexType(), nullptr, static_cast<GLsizei>(commands.size()), 0);
+
+	OPENGL_CHECK_FOR_ERRORS();
+}
@@ -0,0 +1,178 @@
+/*
+	GLTerrainUploader class
+	Stores terrain geometry in OpenGL buffers
+*/
+
+#ifndef GL_TERRAIN_UPLOADER_H
+#define GL_TERRAIN_UPLOADER_H
+
+#include "GLCommon.h"
+#include "GLUploadRing.h"
+#include "Terrain.h"
+
+//Keeps a VAO and VBOs of positions, colors and morph targets per node.
+//Geomorphing factors are passed as constant vertex attributes before each node is drawn
+//(default.vsh). Buffers of unloaded nodes are kept
+//in a pool and reused by the next uploaded nodes, so a terrain with the node cache
+//doesn't create and delete GL objects while the camera moves.
+//Vertex data is copied through a persistently mapped ring buffer if it is supported
+class GLTerrainUploader : public TerrainUploader
+{
+public:
+	void UploadIndices(const void* indices, size_t count, size_t indexSize) override;
+	void UnloadIndices() override;
+	void Release() override;
+	void FlushUploads() override;
+	void UploadNode(
+		size_t index,
+		TerrainNode& node,
+		const vector<vec3>& vertices,
+		const vector<vec3>& colors,
+		const vector<vec2>& morphTargets
+		) override;
+	void UnloadNode(TerrainNode& node) override;
+	size_t GetVertexMemoryUsage() const override { return vertexMemoryUsage; }
+
+	GLuint GetIndicesBufferID() const { return indicesBufferID; }
+	//Type and size of uploaded indices for draw calls
+	GLenum GetIndexType() const { return indexType; }
+	size_t GetIndexSize() const { return indexSize; }
+
+	//Number of node buffers waiting for reuse
+	size_t GetPooledBuffersCount() const { return freeBuffers.size(); }
+
+protected:
+	//Bytes of allocated vertex buffers, including pooled ones
+	size_t vertexMemoryUsage = 0;
+
+	//Store data to the buffer through the upload ring, or directly if it isn't available
+	void CopyToBuffer(GLuint buffer, GLintptr offset, const void* data, size_t size);
+
+private:
+	GLuint indicesBufferID = 0; //VBO for 16 sets of indices
+	GLenum indexType = GL_UNSIGNED_INT;
+	size_t indexSize = sizeof(GLuint);
+
+	struct NodeBuffers
+	{
+		GLuint vaoID;
+		GLuint vboID[3];
+	};
+	vector<NodeBuffers> freeBuffers;
+	GLUploadRing uploadRing;
+	bool uploadRingChecked = false;
+	size_t nodeBufferSize = 0; //bytes of position and color VBOs of a node
+	size_t morphBufferSize = 0; //bytes of morph targets VBO of a node
+
+	//Delete pooled buffers
+	void ReleasePool();
+};
+
+//Packs vertex data of all nodes in shared buffers with a single VAO,
+//so the whole render list is drawn with one glMultiDrawElementsIndirect call.
+//Geomorphing factors of nodes are instance data. Requires ARB_multi_draw_indirect
+class GLBatchedTerrainUploader : public GLTerrainUploader
+{
+public:
+	void Reserve(size_t nodesCount, size_t verticesPerNode) override;
+	void Release() override;
+	void UploadNode(
+		size_t index,
+		TerrainNode& node,
+		const vector<vec3>& vertices,
+		const vector<vec3>& colors,
+		const vector<vec2>& morphTargets
+		) override;
+	void UnloadNode(TerrainNode& node) override;
+
+	//Submit draw commands built by Terrain::BuildDrawCommands
+	//with geomorphing of the render list nodes
+	void Draw(const vector<TerrainDrawCommand>& commands, const vector<TerrainNodeMorph>& morphs);
+
+private:
+	GLuint vaoID = 0;
+	GLuint vboID[3];
+	GLuint morphsBufferID = 0;
+	GLuint commandsBufferID = 0;
+	size_t morphsBufferSize = 0;
+	size_t commandsBufferSize = 0;
+	size_t verticesPerNode = 0;
+};
+
+//Draws all nodes with one shared grid: node placement is passed as instance data
+//and heights are sampled from the heightmap texture in the vertex shader
+//(heightmap.vsh), morph targets too. Requires ARB_multi_draw_indirect and a heightmap
+//not larger than GL_MAX_TEXTURE_SIZE, see IsHeightmapSupported
+class GLHeightmapTerrainUploader : public GLTerrainUploader
+{
+public:
+	void UploadHeightmap(const HeightGrid& hmap, int lodResolution) override;
+	void Release() override;
+	bool UsesNodeVertices() const override { return false; }
+	void UploadNode(
+		size_t /*index*/,
+		TerrainNode& /*node*/,
+		const vector<vec3>& /*vertices*/,
+		const vector<vec3>& /*colors*/,
+		const vector<vec2>& /*morphTargets*/
+		) override {}
+	void UnloadNode(TerrainNode& /*node*/) override {}
+	//Check if the heightmap fits into a texture of the current context
+	static bool IsHeightmapSupported(uvec2 heightmapSize);
+
+	//Submit draw commands, instances and geomorphing of Terrain render list
+	void Draw(
+		const vector<TerrainDrawCommand>& commands,
+		const vector<vec3>& instances,
+		const vector<TerrainNodeMorph>& morphs
+		);
+
+	//Texture unit of the heightmap
+	static const int heightmapUnit = 0;
+
+private:
+	GLuint vaoID = 0;
+	GLuint gridBufferID = 0;
+	GLuint instancesBufferID = 0;
+	GLuint morphsBufferID = 0;
+	GLuint commandsBufferID = 0;
+	GLuint heightmapTextureID = 0;
+	size_t instancesBufferSize = 0;
+	size_t morphsBufferSize = 0;
+	size_t commandsBufferSize = 0;
+};
+
+//Stores a single 16-bit normalized height per vertex of a node, 2 bytes instead of 24
+//of float position and color. Grid coordinates are derived from gl_VertexID and
+//node placement passed as instance data, color is derived from the height in the
+//vertex shader (compact.vsh). Nodes aren't geomorphed. Requires ARB_multi_draw_indirect
+class GLCompactTerrainUploader : public GLTerrainUploader
+{
+public:
+	void Reserve(size_t nodesCount, size_t verticesPerNode) override;
+	void Release() override;
+	void UploadNode(
+		size_t index,
+		TerrainNode& node,
+		const vector<vec3>& vertices,
+		const vector<vec3>& colors,
+		const vector<vec2>& morphTargets
+		) override;
+	void UnloadNode(TerrainNode& node) override;
+
+	//Submit draw commands and instances of Terrain render list
+	void Draw(const vector<TerrainDrawCommand>& commands, const vector<vec3>& instances);
+
+private:
+	GLuint vaoID = 0;
+	GLuint heightsBufferID = 0;
+	GLuint instancesBufferID = 0;
+	GLuint commandsBufferID = 0;
+	size_t instancesBufferSize = 0;
+	size_t commandsBufferSize = 0;
+	size_t verticesPerNode = 0;
+	//Packed heights of the node being uploaded, two per element
+	vector<uint32> packedHeights;
+};
+
+#endif // GL_TERRAIN_UPLOADER_H
@@ -0,0 +1,96 @@
+#include "GLUploadRing.h"
+
+//Time to wait for a copy to finish when the ring is full, in nanoseconds
+#define GL_UPLOAD_RING_WAIT 1000000000
+
+bool GLUploadRing::Create(size_t capacity)
+{
+	Destroy();
+	if (!GLEW_ARB_buffer_storage)
+		return false;
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &bufferID);
+	glBindBuffer(GL_COPY_READ_BUFFER, bufferID);
+	glBufferStorage(GL_COPY_READ_BUFFER, capacity, nullptr, flags);
+	mapped = static_cast<uint8_t*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, capacity, flags));
+	if (!mapped)
+	{
+		WriteToLog("ERROR: Failed to map upload ring buffer\n");
+		Destroy();
+		return false;
+	}
+	allocator.Reset(capacity, 16);
+	OPENGL_CHECK_FOR_ERRORS();
+	return true;
+}
+
+void GLUploadRing::Destroy()
+{
+	for (GLsync fence : fences)
+		glDeleteSync(fence);
+	fences.clear();
+	firstFence = 0;
+	allocator.Reset(0);
+	if (bufferID)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, bufferID);
+		if (mapped)
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &bufferID);
+	}
+	bufferID = 0;
+	mapped = nullptr;
+}
+
+bool GLUploadRing::Upload(GLuint buffer, GLintptr offset, const void* data, size_t size)
+{
+	if (!bufferID || size > allocator.GetCapacity())
+		return false;
+	size_t start;
+	if (!allocator.Allocate(size, start))
+	{
+		//Ring is full: fence own copies and wait for the older ones until there is room
+		Flush();
+		while (!allocator.Allocate(size, start))
+			if (Retire(true) == 0)
+			{
+				WriteToLog("ERROR: Upload ring buffer is stuck\n");
+				return false;
+			}
+	}
+	memcpy(mapped + start, data, size);
+	glBindBuffer(GL_COPY_READ_BUFFER, bufferID);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, start, offset, size);
+	return true;
+}
+
+void GLUploadRing::Flush()
+{
+	if (!bufferID)
+		return;
+	if (allocator.Fence(firstFence + fences.size()))
+		fences.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+	Retire(false);
+}
+
+size_t GLUploadRing::Retire(bool wait)
+{
+	size_t count = allocator.Retire([&](uint64 fence) {
+		GLsync sync = fences[fence - firstFence];
+		GLenum status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_UPLOAD_RING_WAIT : 0);
+		if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+			return false;
+		//Only the oldest fence is waited for
+		wait = false;
+		return true;
+	});
+	for (size_t i = 0; i < count; i++)
+	{
+		glDeleteSync(fences.front());
+		fences.pop_front();
+		firstFence++;
+	}
+	return count;
+}
@@ -0,0 +1,50 @@
+/*
+	GLUploadRing class
+	Persistently mapped staging buffer for uploads to OpenGL buffers
+*/
+
+#ifndef GL_UPLOAD_RING_H
+#define GL_UPLOAD_RING_H
+
+#include "GLCommon.h"
+#include "RingAllocator.h"
+#include <deque>
+
+//Size of the staging ring
+#define GL_UPLOAD_RING_SIZE (8 << 20)
+
+//Data is copied to the mapped ring and moved to the destination buffer by
+//glCopyBufferSubData, so uploads don't stall on buffers used by queued draws.
+//Ranges are reused when the fence issued after their copies is signaled.
+//Requires ARB_buffer_storage
+class GLUploadRing
+{
+public:
+	//Destructor
+	~GLUploadRing() { Destroy(); }
+
+	//Create and map the ring, returns false if persistent mapping isn't supported
+	bool Create(size_t capacity = GL_UPLOAD_RING_SIZE);
+	void Destroy();
+	bool IsCreated() const { return bufferID != 0; }
+
+	//Copy size bytes of data to the buffer at offset.
+	//Returns false if the data doesn't fit the ring, nothing is copied then
+	bool Upload(GLuint buffer, GLintptr offset, const void* data, size_t size);
+	//Fence copies issued since the previous call and reuse ranges of finished ones
+	void Flush();
+
+private:
+	//Retire finished copies, waiting for the oldest one if wait is set.
+	//Returns number of retired fences
+	size_t Retire(bool wait);
+
+	GLuint bufferID = 0;
+	uint8_t* mapped = nullptr;
+	RingAllocator allocator;
+	//Fences in the order of allocator groups, numbered from firstFence
+	deque<GLsync> fences;
+	uint64 firstFence = 0;
+};
+
+#endif // GL_UPLOAD_RING_H
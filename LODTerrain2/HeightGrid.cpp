@@ -0,0 +1,378 @@
+#include "HeightGrid.h"
+
+//SSE is used for bilinear interpolation of whole rows of a sampled grid
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define HEIGHT_GRID_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+static uint16_t EncodeUnorm16(float height)
+{
+	return static_cast<uint16_t>(glm::clamp(height, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+size_t HeightGrid::GetBytesPerSample(int format)
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: return sizeof(uint16_t);
+	case HEIGHT_GRID_HALF: return sizeof(glm::detail::hdata);
+	case HEIGHT_GRID_FLOAT: return sizeof(float);
+	default: throw invalid_argument("Unknown format of height grid.");
+	}
+}
+
+void HeightGrid::Resize(uvec2 newSize, int newFormat)
+{
+	if (newFormat)
+		format = newFormat;
+	ResizeBand(newSize, 0, newSize.y);
+}
+
+void HeightGrid::ResizeBand(uvec2 newSize, unsigned first, unsigned count)
+{
+	size_t bytesPerSample = GetBytesPerSample(format);
+	size_t rowBytes = (newSize.x * bytesPerSample + HEIGHT_GRID_ALIGNMENT - 1) / HEIGHT_GRID_ALIGNMENT * HEIGHT_GRID_ALIGNMENT;
+	size = newSize;
+	stride = rowBytes / bytesPerSample;
+	bandStart = first;
+	bandRows = count;
+	storage.assign(rowBytes / HEIGHT_GRID_ALIGNMENT * bandRows, Block());
+}
+
+void HeightGrid::MoveBand(unsigned first, unsigned count)
+{
+	size_t rowBlocks = stride * GetBytesPerSample() / HEIGHT_GRID_ALIGNMENT;
+	vector<Block> moved(rowBlocks * count, Block());
+	unsigned begin = glm::max(first, bandStart), end = glm::min(first + count, bandStart + bandRows);
+	for (unsigned row = begin; row < end; row++)
+		memcpy(&moved[(row - first) * rowBlocks], &storage[(row - bandStart) * rowBlocks], rowBlocks * sizeof(Block));
+	storage.swap(moved);
+	bandStart = first;
+	bandRows = count;
+}
+
+void HeightGrid::Clear()
+{
+	size = uvec2(0);
+	stride = 0;
+	bandStart = bandRows = 0;
+	vector<Block>().swap(storage);
+}
+
+float HeightGrid::At(unsigned row, unsigned column) const
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: return Decode(GetRow<uint16_t>(row)[column]);
+	case HEIGHT_GRID_HALF: return Decode(GetRow<glm::detail::hdata>(row)[column]);
+	default: return GetRow<float>(row)[column];
+	}
+}
+
+void HeightGrid::Set(unsigned row, unsigned column, float height)
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: GetRow<uint16_t>(row)[column] = EncodeUnorm16(height); break;
+	case HEIGHT_GRID_HALF: GetRow<glm::detail::hdata>(row)[column] = glm::detail::toFloat16(height); break;
+	default: GetRow<float>(row)[column] = height;
+	}
+}
+
+void HeightGrid::SetRow(unsigned row, const float* heights)
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16:
+	{
+		uint16_t* out = GetRow<uint16_t>(row);
+		for (unsigned i = 0; i < size.x; i++)
+			out[i] = EncodeUnorm16(heights[i]);
+		break;
+	}
+	case HEIGHT_GRID_HALF:
+	{
+		glm::detail::hdata* out = GetRow<glm::detail::hdata>(row);
+		for (unsigned i = 0; i < size.x; i++)
+			out[i] = glm::detail::toFloat16(heights[i]);
+		break;
+	}
+	default:
+		memcpy(GetRow<float>(row), heights, size.x * sizeof(float));
+	}
+}
+
+void HeightGrid::SetRow(unsigned row, const uint16_t* heights)
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16:
+		memcpy(GetRow<uint16_t>(row), heights, size.x * sizeof(uint16_t));
+		break;
+	case HEIGHT_GRID_HALF:
+	{
+		glm::detail::hdata* out = GetRow<glm::detail::hdata>(row);
+		for (unsigned i = 0; i < size.x; i++)
+			out[i] = glm::detail::toFloat16(Decode(heights[i]));
+		break;
+	}
+	default:
+	{
+		float* out = GetRow<float>(row);
+		for (unsigned i = 0; i < size.x; i++)
+			out[i] = Decode(heights[i]);
+	}
+	}
+}
+
+void HeightGrid::GetRow(unsigned row, float* heights, unsigned first, unsigned count) const
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16:
+	{
+		const uint16_t* in = GetRow<uint16_t>(row) + first;
+		for (unsigned i = 0; i < count; i++)
+			heights[i] = Decode(in[i]);
+		break;
+	}
+	case HEIGHT_GRID_HALF:
+	{
+		const glm::detail::hdata* in = GetRow<glm::detail::hdata>(row) + first;
+		for (unsigned i = 0; i < count; i++)
+			heights[i] = Decode(in[i]);
+		break;
+	}
+	default:
+		memcpy(heights, GetRow<float>(row) + first, count * sizeof(float));
+	}
+}
+
+void HeightGrid::Assign(const Array2D<vec3>& image)
+{
+	//Array2D keeps GetSize().x rows of GetSize().y elements
+	uvec2 imageSize = image.GetSize();
+	Resize(uvec2(imageSize.y, imageSize.x));
+	vector<float> heights(size.x);
+	const vec3* in = image.GetRawPointer();
+	for (unsigned i = 0; i < size.y; i++, in += size.x)
+	{
+		for (unsigned j = 0; j < size.x; j++)
+			heights[j] = in[j].x;
+		SetRow(i, heights.data());
+	}
+}
+
+template<typename T>
+void HeightGrid::GetRange(vec2& range) const
+{
+	for (unsigned i = bandStart; i < bandStart + bandRows; i++)
+	{
+		const T* in = GetRow<T>(i);
+		for (unsigned j = 0; j < size.x; j++)
+		{
+			float h = Decode(in[j]);
+			range.x = glm::min(range.x, h);
+			range.y = glm::max(range.y, h);
+		}
+	}
+}
+
+vec2 HeightGrid::GetRange() const
+{
+	vec2 range(FLT_MAX, -FLT_MAX);
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: GetRange<uint16_t>(range); break;
+	case HEIGHT_GRID_HALF: GetRange<glm::detail::hdata>(range); break;
+	default: GetRange<float>(range);
+	}
+	return range;
+}
+
+template<typename T>
+float HeightGrid::SampleNearest(vec2 coords) const
+{
+	int i = static_cast<int>(coords.x * (size.y - 1) + 0.5f);
+	int j = static_cast<int>(coords.y * (size.x - 1) + 0.5f);
+	i = glm::clamp(i, 0, static_cast<int>(size.y) - 1);
+	j = glm::clamp(j, 0, static_cast<int>(size.x) - 1);
+	return Decode(GetRow<T>(i)[j]);
+}
+
+float HeightGrid::SampleNearest(vec2 coords) const
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: return SampleNearest<uint16_t>(coords);
+	case HEIGHT_GRID_HALF: return SampleNearest<glm::detail::hdata>(coords);
+	default: return SampleNearest<float>(coords);
+	}
+}
+
+template<typename T>
+float HeightGrid::SampleBilinear(vec2 coords) const
+{
+	float x = coords.x * (size.y - 1), y = coords.y * (size.x - 1);
+	int i = static_cast<int>(x), j = static_cast<int>(y);
+	x -= static_cast<float>(i);	y -= static_cast<float>(j);
+	//Neighbours are clamped to the last row and column, their weight is zero there
+	//unless coordinates exceed 1
+	int lastRow = static_cast<int>(size.y) - 1, lastColumn = static_cast<int>(size.x) - 1;
+	int i1 = glm::min(i + 1, lastRow), j1 = glm::min(j + 1, lastColumn);
+	i = glm::min(i, lastRow);
+	j = glm::min(j, lastColumn);
+	const T* row0 = GetRow<T>(i);
+	const T* row1 = GetRow<T>(i1);
+	return
+		Decode(row0[j]) * (1.0f - x) * (1.0f - y) +
+		Decode(row0[j1]) * (1.0f - x) * y +
+		Decode(row1[j]) * x * (1.0f - y) +
+		Decode(row1[j1]) * x * y;
+}
+
+float HeightGrid::SampleBilinear(vec2 coords) const
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: return SampleBilinear<uint16_t>(coords);
+	case HEIGHT_GRID_HALF: return SampleBilinear<glm::detail::hdata>(coords);
+	default: return SampleBilinear<float>(coords);
+	}
+}
+
+//Indices of both neighbours and their weights for sampling coordinates along one axis
+//of samplesCount samples, computed like SampleBilinear does. Returns true if all
+//coordinates fall on samples
+static bool ComputeAxisWeights(
+	const float* coords,
+	unsigned count,
+	unsigned samplesCount,
+	int* first,
+	int* second,
+	float* firstWeights,
+	float* secondWeights
+	)
+{
+	bool aligned = true;
+	int last = static_cast<int>(samplesCount) - 1;
+	for (unsigned k = 0; k < count; k++)
+	{
+		float c = coords[k] * (samplesCount - 1);
+		int i = static_cast<int>(c);
+		c -= static_cast<float>(i);
+		first[k] = glm::min(i, last);
+		second[k] = glm::min(i + 1, last);
+		firstWeights[k] = 1.0f - c;
+		secondWeights[k] = c;
+		aligned = aligned && c == 0.0f;
+	}
+	return aligned;
+}
+
+//Interpolate a row of the grid between two gathered rows of the heightmap,
+//operations are done in the order of SampleBilinear, so results are equal
+static void InterpolateRow(
+	const float* upper0,
+	const float* upper1,
+	const float* lower0,
+	const float* lower1,
+	float upperWeight,
+	float lowerWeight,
+	const float* weights0,
+	const float* weights1,
+	float* out,
+	unsigned count
+	)
+{
+	unsigned j = 0;
+#ifdef HEIGHT_GRID_USE_SSE
+	__m128 upperWeights = _mm_set1_ps(upperWeight), lowerWeights = _mm_set1_ps(lowerWeight);
+	for (; j + 4 <= count; j += 4)
+	{
+		__m128 w0 = _mm_loadu_ps(weights0 + j), w1 = _mm_loadu_ps(weights1 + j);
+		__m128 res = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(upper0 + j), upperWeights), w0);
+		res = _mm_add_ps(res, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(upper1 + j), upperWeights), w1));
+		res = _mm_add_ps(res, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(lower0 + j), lowerWeights), w0));
+		res = _mm_add_ps(res, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(lower1 + j), lowerWeights), w1));
+		_mm_storeu_ps(out + j, res);
+	}
+#endif
+	for (; j < count; j++)
+		out[j] =
+			upper0[j] * upperWeight * weights0[j] +
+			upper1[j] * upperWeight * weights1[j] +
+			lower0[j] * lowerWeight * weights0[j] +
+			lower1[j] * lowerWeight * weights1[j];
+}
+
+template<typename T>
+void HeightGrid::SampleGrid(const float* xs, unsigned xCount, const float* ys, unsigned yCount, float* out) const
+{
+	vector<int> indices(2 * (xCount + yCount));
+	vector<float> weights(2 * (xCount + yCount));
+	int* rows0 = indices.data();
+	int* rows1 = rows0 + xCount;
+	int* columns0 = rows1 + xCount;
+	int* columns1 = columns0 + yCount;
+	float* rowWeights0 = weights.data();
+	float* rowWeights1 = rowWeights0 + xCount;
+	float* columnWeights0 = rowWeights1 + xCount;
+	float* columnWeights1 = columnWeights0 + yCount;
+	bool aligned = ComputeAxisWeights(xs, xCount, size.y, rows0, rows1, rowWeights0, rowWeights1);
+	aligned = ComputeAxisWeights(ys, yCount, size.x, columns0, columns1, columnWeights0, columnWeights1) && aligned;
+
+	if (aligned)
+	{
+		//Other neighbours have zero weights
+		for (unsigned i = 0; i < xCount; i++, out += yCount)
+		{
+			const T* row = GetRow<T>(rows0[i]);
+			for (unsigned j = 0; j < yCount; j++)
+				out[j] = Decode(row[columns0[j]]);
+		}
+		return;
+	}
+
+	//Both neighbours in the sampled columns of two heightmap rows are gathered to
+	//contiguous arrays, a row shared by adjacent rows of the grid is gathered once
+	vector<float> gathered(4 * yCount);
+	int gatheredRows[2] = { -1, -1 };
+	auto gather = [&](int row, int keptRow) {
+		int slot = gatheredRows[0] == row ? 0 : gatheredRows[1] == row ? 1 : -1;
+		if (slot < 0)
+		{
+			slot = gatheredRows[0] == keptRow ? 1 : 0;
+			const T* in = GetRow<T>(row);
+			float* samples = gathered.data() + 2 * slot * yCount;
+			for (unsigned j = 0; j < yCount; j++)
+			{
+				samples[j] = Decode(in[columns0[j]]);
+				samples[yCount + j] = Decode(in[columns1[j]]);
+			}
+			gatheredRows[slot] = row;
+		}
+		return gathered.data() + 2 * slot * yCount;
+	};
+	for (unsigned i = 0; i < xCount; i++, out += yCount)
+	{
+		const float* upper = gather(rows0[i], rows1[i]);
+		const float* lower = gather(rows1[i], rows0[i]);
+		InterpolateRow(
+			upper, upper + yCount, lower, lower + yCount,
+			rowWeights0[i], rowWeights1[i], columnWeights0, columnWeights1,
+			out, yCount
+			);
+	}
+}
+
+void HeightGrid::SampleGrid(const float* xs, unsigned xCount, const float* ys, unsigned yCount, float* out) const
+{
+	switch (format)
+	{
+	case HEIGHT_GRID_UINT16: SampleGrid<uint16_t>(xs, xCount, ys, yCount, out); break;
+	case HEIGHT_GRID_HALF: SampleGrid<glm::detail::hdata>(xs, xCount, ys, yCount, out); break;
+	default: SampleGrid<float>(xs, xCount, ys, yCount, out);
+	}
+}
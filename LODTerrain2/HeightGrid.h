@@ -0,0 +1,108 @@
+/*
+	HeightGrid class
+	Single channel heightmap with configurable storage of samples
+*/
+
+#ifndef HEIGHT_GRID_H
+#define HEIGHT_GRID_H
+
+#include "Common.h"
+#include "Array2D.h"
+#include <vector>
+
+#define HEIGHT_GRID_UINT16 1 //unsigned normalized 16-bit samples, 65535 is 1
+#define HEIGHT_GRID_HALF 2   //16-bit floating point samples
+#define HEIGHT_GRID_FLOAT 3  //32-bit floating point samples
+
+//Rows start at multiples of this number of bytes
+#define HEIGHT_GRID_ALIGNMENT 16
+
+//Samples are stored row by row, rows are padded to the aligned stride.
+//Heights are read and written as floats, normally in 0..1
+class HeightGrid
+{
+public:
+	HeightGrid(int format = HEIGHT_GRID_FLOAT) : format(format) {}
+
+	//Allocate zero filled grid of size.x samples in a row and size.y rows,
+	//zero format keeps the current one
+	void Resize(uvec2 size, int format = 0);
+	//Allocate only count rows of the grid starting from the first one, for heightmaps
+	//processed band by band. Rows keep their numbers, rows outside the band can't be accessed
+	void ResizeBand(uvec2 size, unsigned first, unsigned count);
+	//Move the band to count rows starting from the first one, rows of both bands are kept
+	void MoveBand(unsigned first, unsigned count);
+	void Clear();
+	bool IsEmpty() const { return size.x == 0 || size.y == 0; }
+
+	//Number of samples in a row and number of rows
+	uvec2 GetSize() const { return size; }
+	int GetFormat() const { return format; }
+	//Rows held in memory, all rows unless the grid is a band
+	unsigned GetBandStart() const { return bandStart; }
+	unsigned GetBandRows() const { return bandRows; }
+	//Samples between starts of adjacent rows
+	size_t GetStride() const { return stride; }
+	size_t GetBytesPerSample() const { return GetBytesPerSample(format); }
+	size_t GetMemoryUsage() const { return storage.size() * sizeof(Block); }
+	static size_t GetBytesPerSample(int format);
+
+	//Raw samples, T must match the format: uint16_t, glm::detail::hdata or float
+	const void* GetData() const { return storage.data(); }
+	template<typename T> const T* GetRow(unsigned row) const
+	{
+		return reinterpret_cast<const T*>(storage.data()) + (row - bandStart) * stride;
+	}
+	template<typename T> T* GetRow(unsigned row)
+	{
+		return reinterpret_cast<T*>(storage.data()) + (row - bandStart) * stride;
+	}
+
+	//Single samples, row is the first index like in Array2D::At
+	float At(unsigned row, unsigned column) const;
+	void Set(unsigned row, unsigned column, float height);
+	//Whole rows of GetSize().x samples, 16-bit values are scaled from 0..65535
+	void SetRow(unsigned row, const float* heights);
+	void SetRow(unsigned row, const uint16_t* heights);
+	void GetRow(unsigned row, float* heights) const { GetRow(row, heights, 0, size.x); }
+	//Part of a row: count samples starting from the first one
+	void GetRow(unsigned row, float* heights, unsigned first, unsigned count) const;
+	//Copy the first channel of an image, At(i, j) of both are equal
+	void Assign(const Array2D<vec3>& image);
+	//Lowest and highest sample
+	vec2 GetRange() const;
+
+	//Sampling at normalized coordinates: x goes from the first row to the last one,
+	//y from the first sample of a row to the last one. Bilinear sampling computes
+	//the same value as Image::operator[] does for the first channel
+	float SampleNearest(vec2 coords) const;
+	float SampleBilinear(vec2 coords) const;
+	//Bilinear samples at crossings of rows and columns given by xs and ys:
+	//out[i * yCount + j] is SampleBilinear(vec2(xs[i], ys[j])). Weights are computed once
+	//per row and column, samples are copied directly when all coordinates fall on samples
+	void SampleGrid(const float* xs, unsigned xCount, const float* ys, unsigned yCount, float* out) const;
+
+private:
+	struct Block
+	{
+		alignas(HEIGHT_GRID_ALIGNMENT) uint8_t bytes[HEIGHT_GRID_ALIGNMENT];
+	};
+
+	static float Decode(uint16_t sample) { return sample / 65535.0f; }
+	static float Decode(glm::detail::hdata sample) { return glm::detail::toFloat32(sample); }
+	static float Decode(float sample) { return sample; }
+
+	template<typename T> float SampleNearest(vec2 coords) const;
+	template<typename T> float SampleBilinear(vec2 coords) const;
+	template<typename T> void SampleGrid(const float* xs, unsigned xCount, const float* ys, unsigned yCount, float* out) const;
+	template<typename T> void GetRange(vec2& range) const;
+
+	int format;
+	uvec2 size;
+	size_t stride = 0;
+	unsigned bandStart = 0;
+	unsigned bandRows = 0;
+	vector<Block> storage;
+};
+
+#endif // HEIGHT_GRID_H
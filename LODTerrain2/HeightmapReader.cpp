@@ -0,0 +1,262 @@
+#include "HeightmapReader.h"
+#include <algorithm>
+#include <cctype>
+
+#ifdef _WIN32
+#define HEIGHTMAP_FSEEK _fseeki64
+#define HEIGHTMAP_FTELL _ftelli64
+#else
+#define HEIGHTMAP_FSEEK fseeko
+#define HEIGHTMAP_FTELL ftello
+#endif
+
+static string GetExtension(const string& filename)
+{
+	size_t dot = filename.rfind('.');
+	string extension = dot == string::npos ? string() : filename.substr(dot + 1);
+	for (char& c : extension)
+		c = static_cast<char>(tolower(c));
+	return extension;
+}
+
+static int GetFileFormat(const string& filename)
+{
+	string extension = GetExtension(filename);
+	if (extension == "raw" || extension == "r16")
+		return HEIGHTMAP_RAW16;
+	if (extension == "r32" || extension == "f32")
+		return HEIGHTMAP_FLOAT32;
+	if (extension == "pgm")
+		return HEIGHTMAP_PGM;
+	return 0;
+}
+
+//Read a decimal number of PGM header, skipping whitespace and comments
+static bool ReadHeaderNumber(FILE* file, unsigned& value)
+{
+	int c = fgetc(file);
+	for (;;)
+	{
+		if (c == '#')
+			while (c != '\n' && c != EOF)
+				c = fgetc(file);
+		else if (isspace(c))
+			c = fgetc(file);
+		else
+			break;
+	}
+	if (!isdigit(c))
+		return false;
+	value = 0;
+	while (isdigit(c))
+	{
+		value = value * 10 + (c - '0');
+		c = fgetc(file);
+	}
+	//Single whitespace character ends the number
+	return isspace(c) != 0;
+}
+
+bool HeightmapReader::IsSupported(const string& filename)
+{
+	return GetFileFormat(filename) != 0;
+}
+
+bool HeightmapReader::Open(const string& name, uvec2 rawSize)
+{
+	Close();
+	filename = name;
+	format = GetFileFormat(filename);
+	if (!format)
+	{
+		WriteToLog("ERROR: Unknown heightmap format of %s\n", filename.c_str());
+		return false;
+	}
+	file = fopen(filename.c_str(), "rb");
+	if (!file)
+	{
+		WriteToLog("ERROR: Can't open heightmap file %s\n", filename.c_str());
+		return false;
+	}
+
+	if (format == HEIGHTMAP_PGM)
+	{
+		unsigned width, height, maxval;
+		if (fgetc(file) != 'P' || fgetc(file) != '5' ||
+			!ReadHeaderNumber(file, width) || !ReadHeaderNumber(file, height) ||
+			!ReadHeaderNumber(file, maxval) || maxval == 0 || maxval > 65535)
+		{
+			WriteToLog("ERROR: %s is not a binary PGM file\n", filename.c_str());
+			Close();
+			return false;
+		}
+		size = uvec2(width, height);
+		bytesPerSample = maxval < 256 ? 1 : 2;
+		maxValue = static_cast<float>(maxval);
+		dataOffset = HEIGHTMAP_FTELL(file);
+	}
+	else
+	{
+		bytesPerSample = format == HEIGHTMAP_RAW16 ? 2 : 4;
+		maxValue = 65535.0f;
+		dataOffset = 0;
+		size = rawSize;
+		if (size.x == 0 || size.y == 0)
+		{
+			//Square file: side is the square root of the number of samples
+			HEIGHTMAP_FSEEK(file, 0, SEEK_END);
+			int64 samples = HEIGHTMAP_FTELL(file) / bytesPerSample;
+			HEIGHTMAP_FSEEK(file, 0, SEEK_SET);
+			unsigned side = static_cast<unsigned>(sqrt(static_cast<double>(samples)) + 0.5);
+			if (static_cast<int64>(side) * side != samples)
+			{
+				WriteToLog("ERROR: Raw heightmap %s isn't square, its size must be given\n", filename.c_str());
+				Close();
+				return false;
+			}
+			size = uvec2(side);
+		}
+	}
+	if (size.x == 0 || size.y == 0)
+	{
+		WriteToLog("ERROR: Heightmap %s is empty\n", filename.c_str());
+		Close();
+		return false;
+	}
+	row.resize(static_cast<size_t>(size.x) * bytesPerSample);
+	nextRow = 0;
+	heightRange = vec2(0.0f);
+	heightRangeSet = false;
+	return true;
+}
+
+void HeightmapReader::Close()
+{
+	if (file)
+		fclose(file);
+	file = nullptr;
+	format = bytesPerSample = 0;
+	size = uvec2(0);
+	nextRow = 0;
+	vector<uint8_t>().swap(row);
+}
+
+bool HeightmapReader::ScanHeightRange()
+{
+	int64 position = HEIGHTMAP_FTELL(file);
+	HEIGHTMAP_FSEEK(file, dataOffset, SEEK_SET);
+	float low = FLT_MAX, high = -FLT_MAX;
+	vector<float> samples(size.x);
+	bool complete = true;
+	for (size_t i = 0; i < size.y; i++)
+	{
+		if (fread(samples.data(), sizeof(float), size.x, file) != size.x)
+		{
+			complete = false;
+			break;
+		}
+		for (float h : samples)
+		{
+			low = glm::min(low, h);
+			high = glm::max(high, h);
+		}
+	}
+	//Next row is read from where it was before the scan, even if the file is truncated
+	HEIGHTMAP_FSEEK(file, position, SEEK_SET);
+	if (!complete)
+		return false;
+	heightRange = vec2(low, high);
+	heightRangeSet = true;
+	return true;
+}
+
+size_t HeightmapReader::ReadRows(size_t count, float* heights)
+{
+	if (!file)
+		return 0;
+	if (format == HEIGHTMAP_FLOAT32 && !heightRangeSet && !ScanHeightRange())
+	{
+		WriteToLog("ERROR: Heightmap %s is truncated\n", filename.c_str());
+		return 0;
+	}
+	count = std::min<size_t>(count, size.y - nextRow);
+	for (size_t r = 0; r < count; r++, heights += size.x)
+	{
+		if (fread(row.data(), 1, row.size(), file) != row.size())
+		{
+			WriteToLog("ERROR: Heightmap %s is truncated\n", filename.c_str());
+			return r;
+		}
+		const uint8_t* data = row.data();
+		if (format == HEIGHTMAP_FLOAT32)
+		{
+			float range = heightRange.y - heightRange.x;
+			float scale = range > 0.0f ? 1.0f / range : 0.0f;
+			memcpy(heights, data, size.x * sizeof(float));
+			for (size_t i = 0; i < size.x; i++)
+				heights[i] = (heights[i] - heightRange.x) * scale;
+		}
+		else if (bytesPerSample == 1)
+			for (size_t i = 0; i < size.x; i++)
+				heights[i] = data[i] / maxValue;
+		else if (format == HEIGHTMAP_PGM)
+			for (size_t i = 0; i < size.x; i++)
+				heights[i] = ((data[2 * i] << 8) | data[2 * i + 1]) / maxValue;
+		else
+			for (size_t i = 0; i < size.x; i++)
+				heights[i] = (data[2 * i] | (data[2 * i + 1] << 8)) / maxValue;
+		nextRow++;
+	}
+	return count;
+}
+
+bool LoadHeightmap(const string& filename, HeightGrid& hmap)
+{
+	uvec2 size;
+	if (!HeightmapReader::IsSupported(filename))
+	{
+		TGAFile tga;
+		if (!tga.Open(filename) || !tga.ReadHeights(hmap))
+			return false;
+		size = hmap.GetSize();
+	}
+	else
+	{
+		HeightmapReader reader;
+		if (!reader.Open(filename))
+			return false;
+		size = reader.GetSize();
+		hmap.Resize(size);
+		vector<float> heights(size.x);
+		for (unsigned i = 0; i < size.y; i++)
+		{
+			if (reader.ReadRows(1, heights.data()) != 1)
+			{
+				hmap.Clear();
+				return false;
+			}
+			hmap.SetRow(i, heights.data());
+		}
+	}
+	WriteToLog("OK: Heightmap %s of %ux%u samples is loaded, %s bytes of %u bytes per sample\n",
+		filename.c_str(), size.x, size.y, ToString(hmap.GetMemoryUsage()).c_str(),
+		static_cast<unsigned>(hmap.GetBytesPerSample()));
+	return true;
+}
+
+bool ReadHeightmapSize(const string& filename, uvec2& size)
+{
+	if (!HeightmapReader::IsSupported(filename))
+	{
+		TGAFile tga;
+		if (!tga.Open(filename))
+			return false;
+		size = tga.GetSize();
+		return true;
+	}
+	HeightmapReader reader;
+	if (!reader.Open(filename))
+		return false;
+	size = reader.GetSize();
+	return true;
+}
@@ -0,0 +1,72 @@
+/*
+	HeightmapReader class
+	Reads high precision heightmaps row by row:
+	16-bit raw, 32-bit float raw and binary PGM files
+*/
+
+#ifndef HEIGHTMAP_READER_H
+#define HEIGHTMAP_READER_H
+
+#include "Common.h"
+#include "TGALoader.h"
+#include <vector>
+
+#define HEIGHTMAP_RAW16 1  //.raw, .r16: little-endian unsigned 16-bit samples
+#define HEIGHTMAP_FLOAT32 2 //.r32, .f32: little-endian 32-bit float samples
+#define HEIGHTMAP_PGM 3     //.pgm: binary greymap (P5), 8 or 16-bit big-endian samples
+
+//Only one row is kept in memory, so files larger than RAM can be read by a caller
+//consuming the rows. LoadHeightmap stores all of them in a grid, so it needs the whole heightmap in memory.
+//Heights are normalized to 0..1: integer samples by their maximum value,
+//float samples by their range, which is found by an extra pass if it isn't given
+class HeightmapReader
+{
+public:
+	//Constructor and destructor
+	HeightmapReader() {}
+	~HeightmapReader() { Close(); }
+
+	//Open file, format is chosen by its extension. Raw files have no header,
+	//their size is taken from the argument or the file is assumed to be square
+	bool Open(const string& filename, uvec2 size = uvec2(0));
+	void Close();
+	bool IsOpen() const { return file != nullptr; }
+	//Set range of float samples mapped to 0..1, must be called before reading
+	void SetHeightRange(vec2 range) { heightRange = range; heightRangeSet = true; }
+
+	//Number of samples in a row and number of rows
+	uvec2 GetSize() const { return size; }
+	int GetFormat() const { return format; }
+	//Read next count rows of GetSize().x heights each, returns number of read rows
+	size_t ReadRows(size_t count, float* heights);
+
+	//Check if the file has an extension of supported format
+	static bool IsSupported(const string& filename);
+
+private:
+	HeightmapReader(const HeightmapReader&);
+	HeightmapReader& operator=(const HeightmapReader&);
+
+	//Find range of float samples, reading the file once
+	bool ScanHeightRange();
+
+	FILE* file = nullptr;
+	string filename;
+	int format = 0;
+	uvec2 size;
+	int bytesPerSample = 0;
+	int64 dataOffset = 0;
+	size_t nextRow = 0;
+	float maxValue = 1.0f; //maximum of integer samples
+	vec2 heightRange = vec2(0.0f);
+	bool heightRangeSet = false;
+	vector<uint8_t> row;
+};
+
+//Load heightmap of any supported format (including TGA) into the grid,
+//samples are converted to the format of the grid
+bool LoadHeightmap(const string& filename, HeightGrid& hmap);
+//Read size of heightmap of any supported format from its header
+bool ReadHeightmapSize(const string& filename, uvec2& size);
+
+#endif // HEIGHTMAP_READER_H
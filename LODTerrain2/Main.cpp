@@ -6,7 +6,9 @@
 #include "Scene.h"
 #include "Camera.h"
 #include "Window.h"
+#include "HeightmapReader.h"
 #include <vector>
+#include <cstring>
 
 void ProcessCamera(Camera& cam, const Window& window, float& speed)
 {
@@ -33,8 +35,38 @@ void ProcessCamera(Camera& cam, const Window& window, float& speed)
 	cam.orientation.y += window.GetMouseSpeed().x;
 }
 
-int main(void)
+//Command line options:
+//  --compact-vertices  store 16-bit height per node vertex instead of heightmap texture
+//  --stream file       stream nodes from terrain pyramid, it is made from land.tga if missing
+//  --stream-budget MB  memory for resident nodes while streaming, 64 MB by default
+//  --cache-budget MB   keep only this much node vertex data of the heightmap resident
+//  --heightmap file    TGA, 16-bit raw (.raw, .r16), float raw (.r32, .f32) or PGM heightmap,
+//                      land.tga by default
+//  --pixel-tolerance N largest screen-space error of terrain nodes in pixels, 2 by default
+int main(int argc, char* argv[])
 {
+	bool compactVertices = false;
+	string streamFile;
+	size_t streamBudget = 64;
+	size_t cacheBudget = 0;
+	string heightmapFile = "land.tga";
+	float pixelTolerance = DEFAULT_PIXEL_TOLERANCE;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--compact-vertices") == 0)
+			compactVertices = true;
+		else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+			streamFile = argv[++i];
+		else if (strcmp(argv[i], "--stream-budget") == 0 && i + 1 < argc)
+			streamBudget = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--cache-budget") == 0 && i + 1 < argc)
+			cacheBudget = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--heightmap") == 0 && i + 1 < argc)
+			heightmapFile = argv[++i];
+		else if (strcmp(argv[i], "--pixel-tolerance") == 0 && i + 1 < argc)
+			pixelTolerance = static_cast<float>(atof(argv[++i]));
+	}
+
 	Window window;
 	ChangeLog("LODTerrain.log");
 	if(!window.Create(uvec2(800, 600), "OpenGL")) 
@@ -45,7 +77,30 @@ int main(void)
 	/*
 		Load shaders
 	*/
-    if(!window.CreateShaderProgram("default.vsh", "default.fsh", "default.gsh"))
+	// Terrain is drawn with one indirect call and heights from texture if possible.
+	// Draw commands address instance data by baseInstance
+	int terrainRenderMode = TERRAIN_RENDER_NODES;
+	const char* vertShaderName = "default.vsh";
+	bool multiDrawIndirect = GLEW_ARB_multi_draw_indirect && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance);
+	// Streamed and cached nodes are stored separately
+	if (multiDrawIndirect && streamFile.empty() && cacheBudget == 0)
+	{
+		uvec2 heightmapSize;
+		if (compactVertices)
+		{
+			terrainRenderMode = TERRAIN_RENDER_COMPACT;
+			vertShaderName = "compact.vsh";
+		}
+		else if (ReadHeightmapSize(heightmapFile, heightmapSize) && GLHeightmapTerrainUploader::IsHeightmapSupported(heightmapSize))
+		{
+			terrainRenderMode = TERRAIN_RENDER_HEIGHTMAP;
+			vertShaderName = "heightmap.vsh";
+		}
+		else
+			// Heightmap doesn't fit into a texture, vertices of all nodes are kept in one buffer
+			terrainRenderMode = TERRAIN_RENDER_BATCHED;
+	}
+    if(!window.CreateShaderProgram(vertShaderName, "default.fsh", "default.gsh"))
         return 1;
 	window.program.Use();
 	WriteToLog("OK: Program is used now\n");
@@ -60,9 +115,46 @@ int main(void)
 	float camSpeed = 0.1f;
 
 	scene.activeCamera = &cam;
+	scene.SetTerrainRenderMode(terrainRenderMode);
+	switch (terrainRenderMode)
+	{
+	case TERRAIN_RENDER_HEIGHTMAP:
+		WriteToLog("OK: Terrain is drawn with multi-draw-indirect from heightmap texture\n");
+		break;
+	case TERRAIN_RENDER_COMPACT:
+		WriteToLog("OK: Terrain is drawn with multi-draw-indirect from compact vertices\n");
+		break;
+	case TERRAIN_RENDER_BATCHED:
+		WriteToLog("OK: Terrain is drawn with multi-draw-indirect from node vertices\n");
+		break;
+	default:
+		WriteToLog("Terrain is drawn node by node\n");
+		break;
+	}
 	cam.FOV = 45.0f;
 	cam.position = glm::vec3(0.0f, 20.0f, 0.0f);
-	scene.terrain.LoadFromFile("land.tga");
+	scene.terrain.pixelTolerance = glm::max(pixelTolerance, 0.1f);
+	if (streamFile.empty())
+	{
+		scene.terrain.nodeCacheBudget = cacheBudget << 20;
+		scene.terrain.LoadFromFile(heightmapFile);
+	}
+	else
+	{
+		FILE* pyramid = fopen(streamFile.c_str(), "rb");
+		if (pyramid)
+			fclose(pyramid);
+		else
+		{
+			// Make pyramid from the heightmap
+			Terrain source(scene.terrain.lodResolution, scene.terrain.maxLOD);
+			HeightGrid hmap(source.heightFormat);
+			if (!LoadHeightmap(heightmapFile, hmap) || !source.LoadFromHeights(hmap) || !source.SaveStream(streamFile, hmap))
+				return EXIT_FAILURE;
+		}
+		if (!scene.terrain.OpenStream(streamFile, streamBudget << 20))
+			return EXIT_FAILURE;
+	}
 	scene.terrain.position = vec3(20.0f, 0.0f, 10.0f);
 	scene.terrain.scale = vec3(60.0f, 25.0f, 60.0f);
 
@@ -93,15 +185,27 @@ int main(void)
 			string(" | Current position: (") +
 			ToString(scene.activeCamera->position.x) + string(", ") +
 			ToString(scene.activeCamera->position.y) + string(", ") +
-			ToString(scene.activeCamera->position.z) + string(")")
+			ToString(scene.activeCamera->position.z) + string(")") +
+			string(" | LOD checks: ") +
+			ToString(scene.terrain.GetReevaluatedNodesCount()) +
+			string(" | Drawn: ") +
+			ToString(scene.terrain.GetCullStatistics().drawnNodes) + string(" of ") +
+			ToString(scene.terrain.GetCullStatistics().selectedNodes) +
+			(scene.terrain.IsCaching() ?
+				string(" | Resident: ") + ToString(scene.terrain.GetResidentNodesCount()) +
+				string(" | Pending: ") + ToString(scene.terrain.GetPendingNodesCount()) +
+				string(" | Hit rate: ") + ToString(scene.terrain.GetCacheStatistics().GetHitRate()) :
+				string())
 			);
 
 		ivec2 size = window.GetSize();
 		glViewport(0, 0, size.x, size.y);
 		cam.aspect = static_cast<float>(size.x) / static_cast<float>(size.y);
 
-		if (counter % 20 == 0)
-			scene.terrain.Renew(scene.activeCamera->position);
+		scene.terrain.viewFOV = cam.FOV;
+		scene.terrain.viewportHeight = static_cast<float>(size.y);
+		scene.terrain.SetFrustum(scene.GetViewProjectionMatrix());
+		scene.terrain.Update(scene.activeCamera->position);
 		scene.Draw(window);
 
 		window.PollEvents();
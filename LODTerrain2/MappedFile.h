@@ -0,0 +1,38 @@
+/*
+	MappedFile class
+	Read-only file mapped to memory
+*/
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "Common.h"
+
+class MappedFile
+{
+public:
+	//Constructor and destructor
+	MappedFile() {}
+	~MappedFile() { Close(); }
+
+	//Map the whole file, pages are read by the system on first access
+	bool Open(const string& filename);
+	void Close();
+	bool IsOpen() const { return data != nullptr; }
+
+	const uint8_t* GetData() const { return data; }
+	uint64 GetSize() const { return size; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const uint8_t* data = nullptr;
+	uint64 size = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,85 @@
+/*
+	This file defines the entry point of the offline tool converting a heightmap
+	to a terrain pyramid, which is opened by Terrain::OpenStream without parsing
+	the heightmap and generating nodes at startup
+
+	Usage: lodterrain_pyramid input output.lodp [options]
+	  --lod-res N   resolution of nodes, even from 4 to 1024, 32 by default
+	  --max-lod N   depth of the terrain quadtree, from 1 to 12, 6 by default
+
+	Input is a TGA file, 16-bit raw (.raw, .r16), 32-bit float raw (.r32, .f32)
+	or binary PGM (.pgm) heightmap. Raw files must be square. Raw and PGM heightmaps
+	are read band by band, only rows covered by one row of the finest nodes are kept
+	in memory, so heightmaps larger than RAM can be converted. TGA heightmaps are
+	loaded to memory, 2 bytes per sample, before nodes are generated
+*/
+
+#include "Terrain.h"
+#include "HeightmapReader.h"
+#include <cstdlib>
+
+int main(int argc, char* argv[])
+{
+	ChangeLog("LODTerrainPyramid.log");
+
+	vector<string> files;
+	int lodResolution = DEFAULT_LOD_RESOLUTION;
+	int maxLOD = DEFAULT_LOD_MAXIMUM;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--lod-res" && hasValue)
+			lodResolution = atoi(argv[++i]);
+		else if (arg == "--max-lod" && hasValue)
+			maxLOD = atoi(argv[++i]);
+		else if (arg.compare(0, 2, "--") != 0)
+			files.push_back(arg);
+		else
+		{
+			fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	if (files.size() != 2 || !IsValidTerrainLOD(lodResolution, maxLOD))
+	{
+		fprintf(stderr, "Usage: lodterrain_pyramid input output.lodp [--lod-res N] [--max-lod N]\n");
+		return EXIT_FAILURE;
+	}
+
+	//Terrain without uploader only generates nodes and their bounds
+	Terrain terrain(lodResolution, maxLOD);
+	if (HeightmapReader::IsSupported(files[0]))
+	{
+		HeightmapReader reader;
+		if (!reader.Open(files[0]))
+		{
+			fprintf(stderr, "Can't load heightmap from %s\n", files[0].c_str());
+			return EXIT_FAILURE;
+		}
+		if (!terrain.SaveStream(files[1], reader))
+		{
+			fprintf(stderr, "Can't write terrain pyramid to %s\n", files[1].c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		HeightGrid hmap(terrain.heightFormat);
+		if (!LoadHeightmap(files[0], hmap))
+		{
+			fprintf(stderr, "Can't load heightmap from %s\n", files[0].c_str());
+			return EXIT_FAILURE;
+		}
+		if (!terrain.LoadFromHeights(hmap) || !terrain.SaveStream(files[1], hmap))
+		{
+			fprintf(stderr, "Can't write terrain pyramid to %s\n", files[1].c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	printf("%s: %u nodes of %dx%d samples\n",
+		files[1].c_str(),
+		static_cast<unsigned>(QuadTree<TerrainNode>::LayerStart(maxLOD + 1)),
+		lodResolution + 1, lodResolution + 1);
+	return EXIT_SUCCESS;
+}
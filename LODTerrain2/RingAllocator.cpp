@@ -0,0 +1,71 @@
+#include "RingAllocator.h"
+
+void RingAllocator::Reset(size_t newCapacity, size_t newAlignment)
+{
+	capacity = newCapacity;
+	alignment = newAlignment > 0 ? newAlignment : 1;
+	head = tail = used = openSize = 0;
+	groups.clear();
+}
+
+bool RingAllocator::Allocate(size_t size, size_t& offset)
+{
+	if (used == 0)
+		head = tail = 0;
+	size_t start = (head + alignment - 1) / alignment * alignment;
+	size_t taken = start - head;
+	if (used > 0 && head <= tail)
+	{
+		//Free space is between head and tail
+		if (start + size > tail)
+			return false;
+	}
+	else if (start + size > capacity)
+	{
+		//Free space is after head and before tail, the range must start from zero
+		if (size > tail || (used == 0 && size > capacity))
+			return false;
+		taken = capacity - head;
+		start = 0;
+	}
+	taken += size;
+	head = start + size;
+	used += taken;
+	openSize += taken;
+	offset = start;
+	return true;
+}
+
+bool RingAllocator::Fence(uint64 fence)
+{
+	if (openSize == 0)
+		return false;
+	Group group;
+	group.fence = fence;
+	group.end = head;
+	group.size = openSize;
+	groups.push_back(group);
+	openSize = 0;
+	return true;
+}
+
+size_t RingAllocator::Retire(function<bool(uint64)> signaled)
+{
+	size_t count = 0;
+	while (!groups.empty() && signaled(groups.front().fence))
+	{
+		tail = groups.front().end;
+		used -= groups.front().size;
+		groups.pop_front();
+		count++;
+	}
+	return count;
+}
+
+bool RingAllocator::GetOldestFence(uint64& fence) const
+{
+	if (groups.empty())
+		return false;
+	fence = groups.front().fence;
+	return true;
+}
@@ -0,0 +1,62 @@
+/*
+	RingAllocator class
+	Allocates ranges of a ring buffer which are released in order
+	when the fences guarding them are signaled
+*/
+
+#ifndef RING_ALLOCATOR_H
+#define RING_ALLOCATOR_H
+
+#include "Common.h"
+#include <deque>
+#include <functional>
+
+//Keeps only offsets, so it serves any buffer: memory mapped from GPU, a file, etc.
+//Allocations made since the previous Fence form a group which is released
+//as a whole when its fence is retired, groups are retired in order
+class RingAllocator
+{
+public:
+	//Constructor
+	RingAllocator(size_t capacity = 0, size_t alignment = 16) { Reset(capacity, alignment); }
+
+	//Forget all allocations and use the ring of capacity bytes,
+	//offsets are multiples of alignment
+	void Reset(size_t capacity, size_t alignment = 16);
+
+	//Allocate size bytes, returns false if there is no room until older groups are retired.
+	//Range never wraps: if it doesn't fit at the end, the rest of the ring is skipped
+	bool Allocate(size_t size, size_t& offset);
+	//Close the group of allocations made since the previous call, fence identifies it.
+	//Returns false if there were no allocations
+	bool Fence(uint64 fence);
+	//Retire groups in order while signaled(fence) is true, returns number of retired groups
+	size_t Retire(function<bool(uint64)> signaled);
+	//Fence of the oldest group in use, returns false if there is none
+	bool GetOldestFence(uint64& fence) const;
+
+	size_t GetCapacity() const { return capacity; }
+	//Bytes in use, including skipped ends and alignment
+	size_t GetUsedSize() const { return used; }
+	//Bytes allocated after the last Fence
+	size_t GetOpenSize() const { return openSize; }
+	size_t GetFencesCount() const { return groups.size(); }
+
+private:
+	struct Group
+	{
+		uint64 fence;
+		size_t end;  //offset after the last allocation of the group
+		size_t size; //bytes taken by the group
+	};
+
+	size_t capacity;
+	size_t alignment;
+	size_t head;     //offset of the next allocation
+	size_t tail;     //offset of the oldest allocation in use
+	size_t used;
+	size_t openSize;
+	deque<Group> groups;
+};
+
+#endif // RING_ALLOCATOR_H
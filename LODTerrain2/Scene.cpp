@@ -1,6 +1,6 @@
 #include "Scene.h"
 
-void Scene::Draw(const Window& window)
+mat4 Scene::GetViewProjectionMatrix() const
 {
 	const mat4 worldmatrix(
 		1.0f, 0.0f, 0.0f, 0.0f, // x-axis is pointing to the right
@@ -8,14 +8,18 @@ void Scene::Draw(const Window& window)
 		0.0f, 0.0f,-1.0f, 0.0f, // and z-axis is pointing to the front of us
 		0.0f, 0.0f, 0.0f, 1.0f
 		);
+	return activeCamera->GetProjectionMatrix() * worldmatrix * activeCamera->GetViewMatrix();
+}
 
+void Scene::Draw(const Window& window)
+{
 	// Enable depth test
 	OPENGL_CALL(glDepthFunc(GL_LESS));
 	// Clear buffer
 	OPENGL_CALL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
 
 	// Get view projection matrix
-	mat4 vpmatrix = activeCamera->GetProjectionMatrix() * worldmatrix * activeCamera->GetViewMatrix();
+	mat4 vpmatrix = GetViewProjectionMatrix();
 	mat4 mvpmatrix;
 
 	//
@@ -41,13 +45,24 @@ void Scene::Draw(const Window& window)
 		1,
 		&wireframeColor[0]
 		);
+	//bind heightmap sampler to its texture unit
+	if (terrainRenderMode == TERRAIN_RENDER_HEIGHTMAP)
+		glUniform1i(
+			glGetUniformLocation(window.program.program, "heightmap"),
+			GLHeightmapTerrainUploader::heightmapUnit
+			);
+	//load node resolution to derive grid coordinates of compact vertices
+	//and to find morph targets in the heightmap
+	if (terrainRenderMode == TERRAIN_RENDER_COMPACT || terrainRenderMode == TERRAIN_RENDER_HEIGHTMAP)
+		glUniform1i(
+			glGetUniformLocation(window.program.program, "lodResolution"),
+			terrain.lodResolution
+			);
 	OPENGL_CHECK_FOR_ERRORS();
 
 	//draw elements of the terrain
 	//currently loaded shader program will process all of these elements
-	DrawTerrainNode(
-		window, terrain.heightmap.Heap()
-		);
+	DrawTerrain();
 
 	// swap buffers and show result on the screen
 	window.SwapBuffers();
@@ -55,27 +70,62 @@ void Scene::Draw(const Window& window)
 	OPENGL_CHECK_FOR_ERRORS();
 }
 
-void Scene::DrawTerrainNode(
-	const Window& window, const QuadTree<TerrainNode>::Iterator& node) const
+void Scene::SetTerrainRenderMode(int mode)
+{
+	terrainRenderMode = mode;
+	switch (mode)
+	{
+	case TERRAIN_RENDER_BATCHED:
+		terrain.uploader = &batchedTerrainUploader;
+		break;
+	case TERRAIN_RENDER_HEIGHTMAP:
+		terrain.uploader = &heightmapTerrainUploader;
+		break;
+	case TERRAIN_RENDER_COMPACT:
+		terrain.uploader = &compactTerrainUploader;
+		break;
+	default:
+		terrainRenderMode = TERRAIN_RENDER_NODES;
+		terrain.uploader = &terrainUploader;
+		break;
+	}
+}
+
+void Scene::DrawTerrain()
 {
-	if (node->enabled)
+	if (!terrain.showSurface)
+		return;
+	if (terrainRenderMode == TERRAIN_RENDER_BATCHED)
+	{
+		terrain.BuildDrawCommands(terrainCommands);
+		batchedTerrainUploader.Draw(terrainCommands, terrain.GetRenderMorphs());
+		return;
+	}
+	if (terrainRenderMode == TERRAIN_RENDER_HEIGHTMAP)
+	{
+		terrain.BuildDrawCommands(terrainCommands, true);
+		heightmapTerrainUploader.Draw(terrainCommands, terrain.GetRenderInstances(), terrain.GetRenderMorphs());
+		return;
+	}
+	if (terrainRenderMode == TERRAIN_RENDER_COMPACT)
 	{
-		if (terrain.showSurface)
-		{
-			glBindVertexArray(node->vaoID);
-			int sparse_bits = 0;
-			for (int i = 0; i < QTREE_NEIGHBOURS_COUNT; i++)
-			if (node.Neighbour(i) && node.Neighbour(i).Parent() && node.Neighbour(i).Parent()->enabled)
-				sparse_bits |= (1 << i);
-			int offset = terrain.lodResolution * terrain.lodResolution * 6 * sparse_bits * sizeof(uint32);
-			glDrawElements(GL_TRIANGLES, terrain.GetIndicesBufferSize(sparse_bits), GL_UNSIGNED_INT, (GLvoid*)offset); // draw colored surface
-		}
+		terrain.BuildDrawCommands(terrainCommands);
+		compactTerrainUploader.Draw(terrainCommands, terrain.GetRenderInstances());
+		return;
 	}
-	else
+	const vector<TerrainNode>& nodes = terrain.heightmap.GetNodes();
+	const vector<TerrainRenderItem>& items = terrain.GetRenderList();
+	const vector<TerrainNodeMorph>& morphs = terrain.GetRenderMorphs();
+	for (size_t i = 0; i < items.size(); i++)
 	{
-		DrawTerrainNode(window, node.Child(1));
-		DrawTerrainNode(window, node.Child(0));
-		DrawTerrainNode(window, node.Child(3));
-		DrawTerrainNode(window, node.Child(2));
+		const TerrainRenderItem& item = items[i];
+		glBindVertexArray(nodes[item.node].vaoID);
+		//geomorphing of the node is constant for all its vertices
+		glVertexAttrib1f(3, morphs[i].factor);
+		glVertexAttrib4fv(4, morphs[i].edges);
+		glDrawElements(
+			GL_TRIANGLES, item.indexCount, terrainUploader.GetIndexType(),
+			reinterpret_cast<const GLvoid*>(item.firstIndex * terrainUploader.GetIndexSize())
+			); // draw colored surface
 	}
 }
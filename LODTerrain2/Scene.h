@@ -6,26 +6,45 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include "GLTerrainUploader.h"
 #include "Terrain.h"
 #include "Window.h"
 #include "Camera.h"
 #include "Common.h"
 
+//Terrain rendering modes
+#define TERRAIN_RENDER_NODES 0     //draw call per node
+#define TERRAIN_RENDER_BATCHED 1   //one indirect draw call, vertices of all nodes in one buffer
+#define TERRAIN_RENDER_HEIGHTMAP 2 //one indirect draw call, shared grid and heightmap texture
+#define TERRAIN_RENDER_COMPACT 3   //one indirect draw call, 16-bit height per vertex
+
 class Scene
 {
 public:
 	//Constructor and destructor
-	Scene() : terrain()  {};
+	Scene() : terrain() { SetTerrainRenderMode(TERRAIN_RENDER_NODES); };
 	~Scene() {};
 	//Pointer to active camera
 	Camera* activeCamera;
 	//Terrain
 	Terrain terrain;
+	//Storage of terrain geometry in GPU memory
+	GLTerrainUploader terrainUploader;
+	GLBatchedTerrainUploader batchedTerrainUploader;
+	GLHeightmapTerrainUploader heightmapTerrainUploader;
+	GLCompactTerrainUploader compactTerrainUploader;
+	//Choose one of TERRAIN_RENDER_* modes, must be done before the terrain is loaded.
+	//Heightmap mode requires heightmap.vsh vertex shader, compact mode requires compact.vsh
+	void SetTerrainRenderMode(int mode);
+	int GetTerrainRenderMode() const { return terrainRenderMode; }
+	//View-projection matrix of the active camera, world space to clip space
+	mat4 GetViewProjectionMatrix() const;
 	//Draw scene to GLFW window
 	void Draw(const Window&);
-	void DrawTerrainNode(
-		const Window& window, const QuadTree<TerrainNode>::Iterator& node
-		) const;
+	void DrawTerrain();
+	//Draw commands of the batched terrain, reused between frames
+	vector<TerrainDrawCommand> terrainCommands;
+	int terrainRenderMode;
 	//Wireframe settings
 	float wireframeThickness = 0.001f;
 	vec3 wireframeColor = vec3(0.0f);
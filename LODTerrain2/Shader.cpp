@@ -155,7 +155,7 @@ bool Shader::CreateFromFile(const string& fileName, GLenum typel)
 	// load source code
 	if (!LoadFile(fileName.c_str(), true, &shaderSource, &sourceLength))
 	{
-		WriteToLog("ERROR: Can't load file %s\n", fileName);
+		WriteToLog("ERROR: Can't load file %s\n", fileName.c_str());
 		OPENGL_CHECK_FOR_ERRORS();
 		glDeleteShader(newshader);
 		return false;
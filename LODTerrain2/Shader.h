@@ -1,4 +1,4 @@
-#include "Common.h"
+#include "GLCommon.h"
 
 /*
 	Shader and Program classes
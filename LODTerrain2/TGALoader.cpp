@@ -45,63 +45,159 @@ bool Image::Save(const string& filename) const
 
 bool Image::Load(const string& filename)
 {
-	FILE *file;
-	unsigned char tga_type[4];
-	unsigned char tga_info[6];
-
-	file = fopen(filename.c_str(), "rb");
+	TGAFile file;
+	return file.Open(filename) && file.ReadColors(*this);
+}
 
-	if (!file)
+bool TGAFile::Open(const string& name)
+{
+	Close();
+	filename = name;
+	if (!file.Open(filename))
 	{
 		WriteToLog("ERROR: Can't open TGA file %s.\n", filename.c_str());
 		return false;
 	}
-
-	fread(&tga_type, sizeof (char), 3, file);
-	fseek(file, 12, SEEK_SET);
-	fread(&tga_info, sizeof (char), 6, file);
-
-	//image type either 2 (color) or 3 (greyscale)
-	if (tga_type[1] != 0)
+	//18-byte header: id length, color map type, image type, color map spec,
+	//origin, width, height, bits per pixel, descriptor
+	const uint8_t* header = file.GetData();
+	if (file.GetSize() < 18)
+	{
+		WriteToLog("ERROR: Can't load TGA file %s. File is truncated\n", filename.c_str());
+		Close();
+		return false;
+	}
+	if (header[1] != 0)
 	{
-		fclose(file);
-		WriteToLog("ERROR: Can't load TGA file %s. idlength should be equal to zero\n", filename.c_str());
+		WriteToLog("ERROR: Can't load TGA file %s. Color map isn't supported\n", filename.c_str());
+		Close();
 		return false;
 	}
-    if (tga_type[1] != 0 || (tga_type[2] != uncompressedColor && tga_type[2] != uncompressedGreyscale))
+	type = header[2];
+	bytesPerPixel = header[16] / 8;
+	size = uvec2(header[12] + header[13] * 256, header[14] + header[15] * 256);
+	pixelsOffset = 18 + header[0];
+	bool greyscale = IsGreyscale();
+	if ((type & ~TGA_RLE_FLAG) != TGA_COLOR && !greyscale)
 	{
-		fclose(file);
-		WriteToLog("ERROR: Can't load TGA file %s. Wrong type: %d\n", filename.c_str(), tga_type[2]);
-		WriteToLog("Only uncompressed types are supported\n");
+		WriteToLog("ERROR: Can't load TGA file %s. Wrong type: %d\n", filename.c_str(), type);
+		WriteToLog("Only color and greyscale types are supported\n");
+		Close();
 		return false;
 	}
+	if (greyscale ? bytesPerPixel != 1 && bytesPerPixel != 2 : bytesPerPixel != 3 && bytesPerPixel != 4)
+	{
+		WriteToLog("ERROR: Can't load TGA file %s. Wrong number of bits: %d\n", filename.c_str(), header[16]);
+		Close();
+		return false;
+	}
+	return true;
+}
 
-	int type = tga_type[2];
-	Resize(uvec2(
-		tga_info[0] + tga_info[1] * 256,
-		tga_info[2] + tga_info[3] * 256
-		));
-	int bytesCount = tga_info[4] / 8;
+void TGAFile::Close()
+{
+	file.Close();
+	vector<uint8_t>().swap(unpacked);
+	size = uvec2(0);
+	type = bytesPerPixel = 0;
+}
 
-	if (bytesCount != 3 && bytesCount != 4)
+const uint8_t* TGAFile::GetPixels()
+{
+	size_t pixelsSize = static_cast<size_t>(size.x) * size.y * bytesPerPixel;
+	const uint8_t* data = file.GetData() + pixelsOffset;
+	const uint8_t* end = file.GetData() + file.GetSize();
+	if (!(type & TGA_RLE_FLAG))
 	{
-		fclose(file);
-		WriteToLog("ERROR: Can't load TGA file %s. Wrong number of bits: %d\n", filename, bytesCount);
-		return false;
+		if (pixelsOffset + pixelsSize > file.GetSize())
+		{
+			WriteToLog("ERROR: Can't load TGA file %s. File is truncated\n", filename.c_str());
+			return nullptr;
+		}
+		return data;
 	}
 
-	int imageSize = GetElementsCount() * bytesCount;
-	unsigned char color[4];
-	//read in image data
-	for (int i = 0; i < GetSize().x; i++)
-	for (int j = 0; j < GetSize().y; j++)
+	//Packet header: 7 bits of count - 1, high bit is set for a repeated pixel
+	unpacked.resize(pixelsSize);
+	uint8_t* out = unpacked.data();
+	uint8_t* outEnd = out + pixelsSize;
+	while (out < outEnd)
+	{
+		if (data >= end)
+			break;
+		uint8_t packet = *data++;
+		size_t count = (packet & 0x7F) + 1;
+		size_t bytes = std::min<size_t>(count * bytesPerPixel, outEnd - out);
+		if (packet & 0x80)
+		{
+			if (end - data < bytesPerPixel)
+				break;
+			for (size_t i = 0; i < bytes; i += bytesPerPixel)
+				memcpy(out + i, data, std::min<size_t>(bytesPerPixel, bytes - i));
+			data += bytesPerPixel;
+		}
+		else
+		{
+			if (static_cast<size_t>(end - data) < count * bytesPerPixel)
+				break;
+			memcpy(out, data, bytes);
+			data += count * bytesPerPixel;
+		}
+		out += bytes;
+	}
+	if (out < outEnd)
 	{
-		fread(color, sizeof(unsigned char), bytesCount, file);
-		At(i, j) = vec3(color[0] / 255.0f, color[1] / 255.0f, color[2] / 255.0f);
+		WriteToLog("ERROR: Can't load TGA file %s. RLE data is truncated\n", filename.c_str());
+		return nullptr;
 	}
+	return unpacked.data();
+}
 
-	//close file
-	fclose(file);
+bool TGAFile::ReadHeights(HeightGrid& heights)
+{
+	const uint8_t* pixels = GetPixels();
+	if (!pixels)
+		return false;
+	heights.Resize(size);
+	//Rows are decoded to 16 bits and converted to the format of the grid by SetRow
+	int stride = bytesPerPixel;
+	vector<uint16_t> row(size.x);
+	for (unsigned i = 0; i < size.y; i++, pixels += size.x * stride)
+	{
+		if (bytesPerPixel == 2)
+			for (unsigned j = 0; j < size.x; j++)
+				row[j] = static_cast<uint16_t>(pixels[2 * j] | (pixels[2 * j + 1] << 8));
+		else
+			//8-bit value v is v * 257 in 16 bits, so 255 goes to 65535
+			for (unsigned j = 0; j < size.x; j++)
+				row[j] = static_cast<uint16_t>(pixels[j * stride] * 257);
+		heights.SetRow(i, row.data());
+	}
+	return true;
+}
 
+bool TGAFile::ReadColors(Array2D<vec3>& colors)
+{
+	const uint8_t* pixels = GetPixels();
+	if (!pixels)
+		return false;
+	colors.Resize(size);
+	vec3* out = colors.GetRawPointer();
+	size_t count = colors.GetElementsCount();
+	if (bytesPerPixel == 2)
+		for (size_t i = 0; i < count; i++)
+			out[i] = vec3((pixels[2 * i] | (pixels[2 * i + 1] << 8)) / 65535.0f);
+	else if (bytesPerPixel == 1)
+		for (size_t i = 0; i < count; i++)
+			out[i] = vec3(pixels[i] / 255.0f);
+	else
+	{
+		int stride = bytesPerPixel;
+		for (size_t i = 0; i < count; i++)
+		{
+			const uint8_t* color = pixels + i * stride;
+			out[i] = vec3(color[0] / 255.0f, color[1] / 255.0f, color[2] / 255.0f);
+		}
+	}
 	return true;
-}
\ No newline at end of file
+}
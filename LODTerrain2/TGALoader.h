@@ -1,7 +1,7 @@
 /*
 	Image class
 	Class for processing images
-	Can read only uncompressed TGA format yet
+	Reads uncompressed and RLE TGA files: 24/32-bit color and 8/16-bit greyscale
 */
 #define _CRT_SECURE_NO_WARNINGS
 
@@ -9,6 +9,44 @@
 #define TGALOADER_H
 
 #include "Array2D.h"
+#include "MappedFile.h"
+#include "HeightGrid.h"
+
+//TGA file mapped to memory, pixels are decoded at once into the array
+//in the order they are stored in the file
+class TGAFile
+{
+public:
+	//Map the file and check its header
+	bool Open(const string& filename);
+	void Close();
+
+	uvec2 GetSize() const { return size; }
+	bool IsGreyscale() const { return (type & ~TGA_RLE_FLAG) == TGA_GREYSCALE; }
+	int GetBytesPerPixel() const { return bytesPerPixel; }
+
+	//Decode the first channel: blue of color images or grey, row by row
+	//into the grid of its format, the full range of pixels is mapped to 0..1
+	bool ReadHeights(HeightGrid& heights);
+	//Decode blue, green and red channels to 0..1, grey goes to all of them
+	bool ReadColors(Array2D<vec3>& colors);
+
+	static const int TGA_COLOR = 2;
+	static const int TGA_GREYSCALE = 3;
+	static const int TGA_RLE_FLAG = 8;
+
+private:
+	//Pixels in the file order, RLE packets are expanded to a buffer
+	const uint8_t* GetPixels();
+
+	MappedFile file;
+	string filename;
+	uvec2 size;
+	int type = 0;
+	int bytesPerPixel = 0;
+	size_t pixelsOffset = 0;
+	vector<uint8_t> unpacked;
+};
 
 class Image : public Array2D<vec3>
 {
@@ -1,15 +1,28 @@
 #include "Terrain.h"
+#include "ThreadPool.h"
+#include "HeightmapReader.h"
+#include <algorithm>
+#include <cfloat>
+
+//SSE is used for batched computations of LOD metric
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TERRAIN_USE_SSE
+#include <xmmintrin.h>
+#endif
 
 //Auxiliary functions
 inline vec2 UniteSegments(const vec2& a, const vec2& b)
 {
-	return vec2(min(a.x, b.x), max(a.x, b.x));
+	return vec2(glm::min(a.x, b.x), glm::max(a.y, b.y));
 }
 
 Terrain::Terrain(int lodRes, int maxLevel)
 {
-	if (maxLevel < 1)
-		throw invalid_argument("Invalid level of details. It must be 1 or higher.");
+	if (maxLevel < 1 || maxLevel > TERRAIN_GRID_MAX_LOD)
+		throw invalid_argument("Invalid level of details. It must be from 1 to " + ToString(TERRAIN_GRID_MAX_LOD) + ".");
+	if (!IsValidTerrainLOD(lodRes, maxLevel))
+		throw invalid_argument("Invalid LOD resolution. It must be even and from " +
+			ToString(TERRAIN_GRID_MIN_RESOLUTION) + " to " + ToString(TERRAIN_GRID_MAX_RESOLUTION) + ".");
 	lodResolution = lodRes;
 	maxLOD = maxLevel;
 	scale = vec3(1.0f);
@@ -20,27 +33,310 @@ Terrain::Terrain(int lodRes, int maxLevel)
 Terrain::~Terrain(void) {}
 
 bool Terrain::LoadFromFile(const string& filename)
+{
+	WriteToLog("Loading heightmap from file...\n");
+	HeightGrid hmap(heightFormat);
+	if (!LoadHeightmap(filename, hmap))
+	{
+		WriteToLog("ERROR: Failed to load heightmap.\n");
+		return false;
+	}
+	return LoadFromHeights(hmap);
+}
+
+bool Terrain::LoadFromImage(const Image& img)
+{
+	HeightGrid hmap;
+	hmap.Assign(img);
+	return LoadFromHeights(hmap);
+}
+
+bool Terrain::LoadFromHeights(const HeightGrid& hmap)
 {
 	//Unload previous terrain, if exists
 	Unload();
 
-	WriteToLog("Loading heightmap from TGA file...\n");
-	Image img;
-	if (!img.Load(filename))
+	//Allocate complete quadtree
+	ResetNodes();
+
+	//Load neccessary data to GPU
+	PrepareIndices();
+	if (uploader)
 	{
-		WriteToLog("ERROR: Failed to load heightmap.\n");
+		uploader->Reserve(heightmap.GetNodes().size(), GetNodeVerticesCount());
+		uploader->UploadHeightmap(hmap, lodResolution);
+	}
+	bool cached = nodeCacheBudget > 0 && (!uploader || uploader->UsesNodeVertices());
+	if (cached)
+	{
+		//Only bounds are computed now, nodes are generated when they are needed
+		WriteToLog("Computing bounds of nodes...\n");
+		LoadVertices(hmap, false);
+		cacheHeightmap = hmap;
+		for (TerrainNode& node : heightmap.GetNodes())
+			node.resident = false;
+		StartNodeCache(nodeCacheBudget);
+		WriteToLog("OK: Terrain was loaded, %s of %s nodes can be resident\n",
+			ToString(nodeCache.GetCapacity()).c_str(), ToString(heightmap.GetNodes().size()).c_str());
+	}
+	else
+	{
+		WriteToLog("Loading all vertex data to VAO...\n");
+		LoadVertices(hmap, !uploader || uploader->UsesNodeVertices());
+		WriteToLog("OK: Terrain was loaded\n");
+	}
+	if (uploader && !cached)
+	{
+		//Compare with float position and color of every vertex of every node
+		size_t verticesCount = heightmap.GetNodes().size() * GetNodeVerticesCount();
+		size_t fullSize = verticesCount * 2 * sizeof(vec3);
+		size_t usedSize = uploader->GetVertexMemoryUsage();
+		WriteToLog(
+			"Vertex data: %s bytes for %s vertices, %.2f bytes per vertex, %.1fx less than %s bytes of float position and color\n",
+			ToString(usedSize).c_str(), ToString(verticesCount).c_str(),
+			static_cast<double>(usedSize) / verticesCount,
+			usedSize ? static_cast<double>(fullSize) / usedSize : 0.0,
+			ToString(fullSize).c_str()
+			);
+	}
+	return true;
+}
+
+bool Terrain::SaveStream(const string& filename, const HeightGrid& hmap)
+{
+	TerrainStreamHeader header;
+	header.magic = TERRAIN_STREAM_MAGIC;
+	header.version = TERRAIN_STREAM_VERSION;
+	header.lodResolution = lodResolution;
+	header.maxLOD = maxLOD;
+	header.nodesCount = heightmap.GetNodes().size();
+	//Node heights are interpolated, so they don't exceed the range of the heightmap
+	vec2 range = hmap.GetRange();
+	header.heightMin = range.x;
+	header.heightMax = range.y;
+	vector<vec2> bounds;
+	vector<float> errors;
+	for (const TerrainNode& node : heightmap.GetNodes())
+	{
+		bounds.push_back(node.heights);
+		errors.push_back(node.error);
+	}
+
+	WriteToLog("Writing terrain pyramid...\n");
+	vector<vec3> vertices, colors;
+	bool ok = TerrainStream::Write(filename, header, bounds, errors, [&](size_t index, vector<float>& heights) {
+		BuildNodeVertices(heightmap.Node(index), hmap, vertices, colors);
+		heights.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++)
+			heights[i] = vertices[i].y;
+	});
+	if (ok)
+		WriteToLog("OK: Terrain pyramid %s was written\n", filename.c_str());
+	return ok;
+}
+
+bool Terrain::SaveStream(const string& filename, HeightmapReader& reader)
+{
+	Unload();
+	ResetNodes();
+	TerrainStreamHeader header;
+	header.magic = TERRAIN_STREAM_MAGIC;
+	header.version = TERRAIN_STREAM_VERSION;
+	header.lodResolution = lodResolution;
+	header.maxLOD = maxLOD;
+	header.nodesCount = heightmap.GetNodes().size();
+	//Reader normalizes heights to 0..1, the range is unknown until all rows are read
+	header.heightMin = 0.0f;
+	header.heightMax = 1.0f;
+	TerrainStreamWriter writer;
+	if (!writer.Create(filename, header))
+	{
+		Unload();
 		return false;
 	}
 
-	//Load neccessary data to GPU
-	WriteToLog("Generating indices...\n");
-	GenerateIndices();
-	WriteToLog("Loading all vertex data to VAO...\n");
-	LoadVertices(heightmap.Heap(), img);
-	WriteToLog("OK: Terrain was loaded\n");
+	WriteToLog("Writing terrain pyramid band by band...\n");
+	//Heights of the last two rows of nodes of every layer, a row of parents
+	//is reduced when the second row of their children is done
+	const size_t samplesCount = GetNodeVerticesCount();
+	vector<vector<float>> layerRows(maxLOD + 1);
+	for (int level = 0; level <= maxLOD; level++)
+		layerRows[level].resize(2 * (size_t(1) << level) * samplesCount);
+	auto nodeAt = [&](int level, uvec2 coord) {
+		return heightmap.Node(QuadTree<TerrainNode>::LayerStart(level) + QuadTree<TerrainNode>::MortonCode(coord));
+	};
+	auto nodeHeights = [&](int level, uvec2 coord) {
+		return &layerRows[level][((coord.x & 1) * (size_t(1) << level) + coord.y) * samplesCount];
+	};
+	auto writeRow = [&](int level, unsigned row) {
+		bool written = true;
+		for (unsigned c = 0; written && c < (1u << level); c++)
+			written = writer.WriteNode(nodeAt(level, uvec2(row, c)).Index(), nodeHeights(level, uvec2(row, c)));
+		return written;
+	};
+
+	ThreadPool pool(loadThreadsCount);
+	TerrainGrid grid(lodResolution);
+	const int half = lodResolution / 2, size = lodResolution + 1;
+	const unsigned layerSize = 1u << maxLOD;
+	uvec2 hmapSize = reader.GetSize();
+	HeightGrid band(heightFormat);
+	band.ResizeBand(hmapSize, 0, 0);
+	vector<float> samples(hmapSize.x);
+	unsigned readRows = 0;
+	bool ok = true;
+	for (unsigned r = 0; ok && r < layerSize; r++)
+	{
+		//Heightmap rows sampled by the row of the finest nodes, with a margin for rounding.
+		//Next band starts before this one ends, so every row is read once
+		float rowScale = static_cast<float>(hmapSize.y - 1) / layerSize;
+		unsigned first = static_cast<unsigned>(glm::max(floor(r * rowScale) - 1.0f, 0.0f));
+		unsigned last = glm::min(static_cast<unsigned>(ceil((r + 1) * rowScale)) + 1, hmapSize.y - 1);
+		band.MoveBand(first, last - first + 1);
+		for (; ok && readRows <= last; readRows++)
+		{
+			ok = reader.ReadRows(1, samples.data()) == 1;
+			band.SetRow(readRows, samples.data());
+		}
+		if (!ok)
+			break;
+
+		pool.Run(layerSize, [&](size_t c) {
+			QuadTree<TerrainNode>::Iterator node = nodeAt(maxLOD, uvec2(r, c));
+			vector<float> xs, ys, heights;
+			SampleNodeGrid(node, band, xs, ys, heights);
+			node->heights = vec2(1.0f, 0.0f);
+			for (float h : heights)
+				node->heights = UniteSegments(node->heights, vec2(h));
+			node->error = ComputeNodeError(node, band, heights.data(), 1);
+			copy(heights.begin(), heights.end(), nodeHeights(maxLOD, node.Offset()));
+		});
+		ok = writeRow(maxLOD, r);
+
+		//Parent vertices are every second vertex of the children, children farther from
+		//the parent grid than their error make the parent's error larger
+		unsigned childRow = r;
+		for (int level = maxLOD - 1; ok && level >= 0 && (childRow & 1); level--)
+		{
+			unsigned row = childRow / 2;
+			pool.Run(size_t(1) << level, [&](size_t c) {
+				QuadTree<TerrainNode>::Iterator node = nodeAt(level, uvec2(row, c));
+				float* heights = nodeHeights(level, node.Offset());
+				float error = 0.0f;
+				node->heights = vec2(1.0f, 0.0f);
+				for (unsigned a : { 0, 1 })
+				for (unsigned b : { 0, 1 })
+				{
+					uvec2 childCoord = uvec2(2 * row + a, 2 * c + b);
+					const float* childHeights = nodeHeights(level + 1, childCoord);
+					for (int i = 0; i <= half; i++)
+						for (int j = 0; j <= half; j++)
+							heights[(a * half + i) * size + b * half + j] = childHeights[2 * i * size + 2 * j];
+					QuadTree<TerrainNode>::Iterator child = nodeAt(level + 1, childCoord);
+					node->heights = UniteSegments(node->heights, child->heights);
+					error = glm::max(error, child->error + grid.ComputeParentDistance(childHeights));
+				}
+				node->error = error > TERRAIN_ERROR_EPSILON ? error : 0.0f;
+			});
+			ok = writeRow(level, row);
+			childRow = row;
+		}
+	}
+
+	if (ok)
+	{
+		vector<vec2> bounds;
+		vector<float> errors;
+		for (const TerrainNode& node : heightmap.GetNodes())
+		{
+			bounds.push_back(node.heights);
+			errors.push_back(node.error);
+		}
+		ok = writer.Finish(bounds, errors);
+	}
+	else
+	{
+		writer.Close();
+		WriteToLog("ERROR: Failed to write terrain pyramid %s\n", filename.c_str());
+	}
+	if (ok)
+		WriteToLog("OK: Terrain pyramid %s was written\n", filename.c_str());
+	Unload();
+	return ok;
+}
+
+bool Terrain::OpenStream(const string& filename, size_t budget)
+{
+	//Unload previous terrain, if exists
+	Unload();
+	if (uploader && !uploader->UsesNodeVertices())
+	{
+		WriteToLog("ERROR: Terrain uploader doesn't support streaming of node vertices\n");
+		return false;
+	}
+	if (!stream.Open(filename))
+		return false;
+
+	const TerrainStreamHeader& header = stream.GetHeader();
+	lodResolution = header.lodResolution;
+	maxLOD = header.maxLOD;
+	ResetNodes();
+	vector<TerrainNode>& nodes = heightmap.GetNodes();
+	if (nodes.size() != header.nodesCount)
+	{
+		WriteToLog("ERROR: Terrain pyramid %s has wrong number of nodes\n", filename.c_str());
+		stream.Close();
+		return false;
+	}
+	const vec2* bounds = stream.GetBounds();
+	const float* errors = stream.GetErrors();
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		nodes[i].heights = bounds[i];
+		nodes[i].error = errors[i];
+		nodes[i].resident = false;
+	}
+
+	PrepareIndices();
+	if (uploader)
+		uploader->Reserve(nodes.size(), GetNodeVerticesCount());
+
+	StartNodeCache(budget);
+	WriteToLog("OK: Terrain pyramid is opened for streaming, %s of %s nodes can be resident\n",
+		ToString(nodeCache.GetCapacity()).c_str(), ToString(nodes.size()).c_str());
 	return true;
 }
 
+void Terrain::StartNodeCache(size_t budget)
+{
+	nodeCache.Reset(budget, GetNodeVertexBytes(), TERRAIN_STREAM_MIN_RESIDENT);
+	loadScheduler.Start(cacheThreadsCount,
+		[this](size_t index, vector<vec3>& vertices, vector<vec3>& colors, vector<vec2>& morphTargets) {
+			return LoadNode(index, vertices, colors, morphTargets);
+		});
+
+	//Root is always resident, so there is always something to draw
+	NodeStaging root;
+	LoadNode(0, root.vertices, root.colors, root.morphTargets);
+	MakeResident(heightmap.Heap(), root.vertices, root.colors, root.morphTargets);
+	if (uploader)
+		uploader->FlushUploads();
+	nodesArrived = false;
+}
+
+void Terrain::ResetNodes()
+{
+	heightmap.Reset(maxLOD + 1);
+	splitNodes.clear();
+	disabledNodes.clear();
+	renderList.clear();
+	renderInstances.clear();
+	renderMorphs.clear();
+	visibleList.clear();
+	visibleInstances.clear();
+	lodStateValid = false;
+}
+
 mat4 Terrain::GetModelMatrix() const
 {
 	mat4 mmatrix = translate(position);
@@ -50,435 +346,945 @@ mat4 Terrain::GetModelMatrix() const
 	return glm::scale(mmatrix, scale);
 }
 
-vec2 Terrain::LoadVertices(
-	const QuadTree<TerrainNode>::Iterator& node, 
-	const Image& hmap
-	)
+vec2 Terrain::BuildNodeVertices(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const HeightGrid& hmap,
+	vector<vec3>& vertices,
+	vector<vec3>& colors
+	) const
+{
+	int verticesCount = GetNodeVerticesCount();
+	vertices.resize(verticesCount);
+	colors.resize(verticesCount);
+	vector<float> xs, ys, heights;
+	SampleNodeGrid(node, hmap, xs, ys, heights);
+	return TerrainGrid(lodResolution).BuildVertices(xs.data(), ys.data(), heights.data(), vertices.data(), colors.data());
+}
+
+void Terrain::BuildNodeVertices(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const uint16_t* heights,
+	vec2 heightRange,
+	vector<vec3>& vertices,
+	vector<vec3>& colors
+	) const
+{
+	int verticesCount = GetNodeVerticesCount();
+	vertices.resize(verticesCount);
+	colors.resize(verticesCount);
+	float delta = 1.0f / node.LayerSize() / lodResolution;
+	TerrainGrid(lodResolution).BuildVertices(node.OffsetFloat(), delta, heights, heightRange, vertices.data(), colors.data());
+}
+
+void Terrain::BuildMorphTargets(const vector<vec3>& vertices, vector<vec2>& morphTargets) const
+{
+	morphTargets.resize(vertices.size());
+	TerrainGrid(lodResolution).BuildMorphTargets(vertices.data(), morphTargets.data());
+}
+
+vec2 Terrain::BuildNodeHeights(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const HeightGrid& hmap,
+	float* error
+	) const
 {
-	//Setup vertex data
 	vec2 res = vec2(1.0f, 0.0f);
-	int verticesCount = (lodResolution + 1) * (lodResolution + 1);
-	vector<vec3> vertices(verticesCount), colors(verticesCount);
-	float deltaX = 1.0f / node.LayerSize() / lodResolution;
-	float deltaY = 1.0f / node.LayerSize() / lodResolution;
-	float x = node.OffsetFloat().x;
-	for (int i = 0; i <= lodResolution; i++, x += deltaX)
+	vector<float> xs, ys, heights;
+	SampleNodeGrid(node, hmap, xs, ys, heights);
+	for (float h : heights)
+		res = UniteSegments(res, vec2(h));
+	if (error)
+		*error = ComputeNodeError(node, hmap, heights.data(), 1);
+	return res;
+}
+
+float Terrain::ComputeNodeError(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const HeightGrid& hmap,
+	const float* heights,
+	size_t stride
+	) const
+{
+	uvec2 size = hmap.GetSize();
+	if (size.x < 2 || size.y < 2)
+		return 0.0f;
+	//Heightmap samples inside node bounds, sample (r, c) is at (r / (rows - 1), c / (columns - 1))
+	float nodeSize = 1.0f / node.LayerSize();
+	vec2 offset = node.OffsetFloat();
+	vec2 sampleScale = vec2(size.y - 1, size.x - 1);
+	uvec2 first = uvec2(ceil(offset * sampleScale));
+	uvec2 last = glm::min(uvec2(floor((offset + nodeSize) * sampleScale)), uvec2(size.y - 1, size.x - 1));
+	if (first.x > last.x || first.y > last.y)
+		return 0.0f;
+
+	//Grid cell and position inside it of every column, cells are split by the diagonal
+	//from (i, j) to (i + 1, j + 1) like in the central part of the grid
+	float cellScale = static_cast<float>(node.LayerSize() * lodResolution);
+	unsigned columnsCount = last.y - first.y + 1;
+	vector<int> cellColumns(columnsCount);
+	vector<float> columnFractions(columnsCount), samples(columnsCount);
+	for (unsigned k = 0; k < columnsCount; k++)
 	{
-		float y = node.OffsetFloat().y;
-		for (int j = 0; j <= lodResolution; j++, y += deltaY)
+		float y = glm::max(((first.y + k) / sampleScale.y - offset.y) * cellScale, 0.0f);
+		cellColumns[k] = glm::min(static_cast<int>(y), lodResolution - 1);
+		columnFractions[k] = y - cellColumns[k];
+	}
+
+	size_t rowStride = (lodResolution + 1) * stride;
+	float error = 0.0f;
+	for (unsigned r = first.x; r <= last.x; r++)
+	{
+		float x = glm::max((r / sampleScale.x - offset.x) * cellScale, 0.0f);
+		int i = glm::min(static_cast<int>(x), lodResolution - 1);
+		float fx = x - i;
+		const float* row0 = heights + i * rowStride;
+		const float* row1 = row0 + rowStride;
+		hmap.GetRow(r, samples.data(), first.y, columnsCount);
+		for (unsigned k = 0; k < columnsCount; k++)
 		{
-			float h = hmap[vec2(x, y)].x;
-			res = UniteSegments(res, vec2(h));
+			size_t j = cellColumns[k] * stride;
+			float fy = columnFractions[k];
+			float h00 = row0[j], h01 = row0[j + stride];
+			float h10 = row1[j], h11 = row1[j + stride];
+			float h = fy >= fx ?
+				h00 + fy * (h01 - h00) + fx * (h11 - h01) :
+				h00 + fx * (h10 - h00) + fy * (h11 - h10);
+			error = glm::max(error, abs(samples[k] - h));
+		}
+	}
+	return error > TERRAIN_ERROR_EPSILON ? error : 0.0f;
+}
 
-			vertices[i*lodResolution + i + j] = vec3(x, h, y);
-			colors[i*lodResolution + i + j] = vec3(0.2f, 0.2f + h, 0.4f - h);
+float Terrain::GetLODThreshold() const
+{
+	//Error e at distance d covers e * viewportHeight / (2 * d * tan(FOV / 2)) pixels
+	return viewportHeight / (2.0f * tan(radians(viewFOV) * 0.5f) * pixelTolerance);
+}
+
+void Terrain::SampleNodeGrid(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const HeightGrid& hmap,
+	vector<float>& xs,
+	vector<float>& ys,
+	vector<float>& heights
+	) const
+{
+	//Coordinates are accumulated along each axis, all rows share the columns
+	xs.resize(lodResolution + 1);
+	ys.resize(lodResolution + 1);
+	heights.resize((lodResolution + 1) * (lodResolution + 1));
+	float delta = 1.0f / node.LayerSize() / lodResolution;
+	float x = node.OffsetFloat().x;
+	for (int i = 0; i <= lodResolution; i++, x += delta)
+		xs[i] = x;
+	float y = node.OffsetFloat().y;
+	for (int j = 0; j <= lodResolution; j++, y += delta)
+		ys[j] = y;
+	hmap.SampleGrid(xs.data(), lodResolution + 1, ys.data(), lodResolution + 1, heights.data());
+}
+
+void Terrain::LoadVertices(const HeightGrid& hmap, bool buildVertices)
+{
+	ThreadPool pool(loadThreadsCount);
+	size_t nodesCount = heightmap.GetNodes().size();
+
+	if (!buildVertices)
+	{
+		//Only height ranges are needed, all nodes are independent
+		pool.Run(nodesCount, [&](size_t i) {
+			QuadTree<TerrainNode>::Iterator node = heightmap.Node(i);
+			node->heights = BuildNodeHeights(node, hmap, &node->error);
+		});
+	}
+	else
+	{
+		//Nodes are generated by batches to bound staging memory:
+		//while workers generate the next batch, this thread uploads the previous one
+		size_t batchSize = TERRAIN_LOAD_BATCH_PER_THREAD * (pool.GetThreadsCount() + 1);
+		size_t batchesCount = (nodesCount + batchSize - 1) / batchSize;
+		auto startBatch = [&](size_t batch) {
+			size_t first = batch * batchSize;
+			size_t count = std::min<size_t>(batchSize, nodesCount - first);
+			vector<NodeStaging>& staging = loadStaging[batch % 2];
+			staging.resize(count);
+			pool.Start(count, [&, first](size_t i) {
+				QuadTree<TerrainNode>::Iterator node = heightmap.Node(first + i);
+				node->heights = BuildNodeVertices(node, hmap, staging[i].vertices, staging[i].colors);
+				node->error = ComputeNodeError(node, hmap, &staging[i].vertices[0].y, 3);
+				BuildMorphTargets(staging[i].vertices, staging[i].morphTargets);
+			});
+		};
+		if (batchesCount > 0)
+			startBatch(0);
+		for (size_t batch = 0; batch < batchesCount; batch++)
+		{
+			pool.Wait();
+			if (batch + 1 < batchesCount)
+				startBatch(batch + 1);
+			UploadBatch(batch * batchSize, loadStaging[batch % 2]);
 		}
+		for (vector<NodeStaging>& staging : loadStaging)
+			vector<NodeStaging>().swap(staging);
 	}
 
-	// VAO allocation
-	glGenVertexArrays(1, &node->vaoID);
-	// VAO setup
-	glBindVertexArray(node->vaoID);
-	// VBOs allocation
-	glGenBuffers(2, node->vboID);
-	// VBOs setup
-	// vertices buffer
-	glBindBuffer(GL_ARRAY_BUFFER, node->vboID[0]);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * 3 * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
-	glEnableVertexAttribArray(0);
-	// colors buffer
-	glBindBuffer(GL_ARRAY_BUFFER, node->vboID[1]);
-	glBufferData(GL_ARRAY_BUFFER, colors.size() * 3 * sizeof(GLfloat), colors.data(), GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), 0);
-	glEnableVertexAttribArray(1);
-	// indices buffer
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, GetIndicesBufferID());
-
-	OPENGL_CHECK_FOR_ERRORS();
-	// release vertex data
-	vertices.clear();
-	colors.clear();
-
-	if (node.Level() < maxLOD)
-	{
-        for (int i : {0, 1, 2, 3})
-            res = UniteSegments(res, LoadVertices(node.Add(i), hmap));
-	}
-	node->heights = res;
+	UniteSubtreeHeights();
+}
 
-	return res;
+void Terrain::UploadBatch(size_t first, vector<NodeStaging>& staging)
+{
+	if (!uploader)
+		return;
+	vector<TerrainNode>& nodes = heightmap.GetNodes();
+	for (size_t i = 0; i < staging.size(); i++)
+		uploader->UploadNode(first + i, nodes[first + i], staging[i].vertices, staging[i].colors, staging[i].morphTargets);
+	uploader->FlushUploads();
 }
 
-void Terrain::UnloadVertices(const QuadTree<TerrainNode>::Iterator& node)
+void Terrain::UniteSubtreeHeights()
 {
-	if (node->vaoID)
+	//Children are stored after their parents, so going backwards
+	//every child already contains the range and the error of its subtree.
+	//Errors don't decrease towards the root, so a node is split only if its children
+	//have something to add
+	for (size_t i = QuadTree<TerrainNode>::LayerStart(maxLOD); i-- > 0;)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glDeleteBuffers(2, node->vboID);
-		glBindVertexArray(0);
-		glDeleteVertexArrays(1, &node->vaoID);
-		node->vaoID = NULL;
+		QuadTree<TerrainNode>::Iterator node = heightmap.Node(i);
+		for (int j : {0, 1, 2, 3})
+		{
+			node->heights = UniteSegments(node->heights, node.Child(j)->heights);
+			node->error = glm::max(node->error, node.Child(j)->error);
+		}
 	}
+}
 
-	for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
-		if (node.Child(i))
-			UnloadVertices(node.Child(i));
+void Terrain::UnloadVertices()
+{
+	if (uploader)
+		for (TerrainNode& node : heightmap.GetNodes())
+			uploader->UnloadNode(node);
 }
 
 void Terrain::Unload()
 {
-	UnloadVertices(heightmap.Heap());
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	glDeleteBuffers(1, &indicesBufferID);
+	if (IsCaching())
+	{
+		TerrainLoadStatistics statistics = loadScheduler.GetStatistics();
+		WriteToLog("Node loads: %s completed, %s cancelled, latency %.2f ms median, %.2f ms at 99th percentile\n",
+			ToString(statistics.completed).c_str(), ToString(statistics.cancelled).c_str(),
+			loadScheduler.GetLatencyPercentile(0.5), loadScheduler.GetLatencyPercentile(0.99));
+	}
+	loadScheduler.Stop();
+	stream.Close();
+	nodeCache.Clear();
+	cacheHeightmap.Clear();
+	streamPendingCount = 0;
+	nodesArrived = false;
+	loadedNodes.clear();
+	cancelledNodes.clear();
+	streamWanted.clear();
+	blockedNodes.clear();
+	UnloadVertices();
+	if (uploader)
+	{
+		uploader->Release();
+		uploader->UnloadIndices();
+	}
+	indices.clear();
 	WriteToLog("OK: Terrain was unloaded\n");
 }
 
 void Terrain::GenerateIndices()
 {
-	const int VBOSize = lodResolution * lodResolution * 6 * 16;
-	vector<GLuint> indices(VBOSize);
-	vector<GLuint>::iterator ptr;
-	int i, u, v, count;
-	for(i = 0; i < 16; i++)
-	{
-		ptr = indices.begin() + lodResolution * lodResolution * 6 * i;
-		count = 0;
-		//
-		//UPPER SIDE
-		//
-		if(i & TERRAIN_GRID_SPARSE_UPPER)
-		{
-			v = 0;
-			ptr[count++] = v;
-			ptr[count++] = v + lodResolution + 2;
-			ptr[count++] = v + 2;
- 
-			ptr[count++] = v + 2;
-			ptr[count++] = v + lodResolution + 2;
-			ptr[count++] = v + lodResolution + 3;
-
-			for (v = 2; v < lodResolution-2 ; v+=2)
-			{
-				ptr[count++] = v;
-				ptr[count++] = v + lodResolution + 1;
-				ptr[count++] = v + lodResolution + 2;
- 
-				ptr[count++] = v;
-				ptr[count++] = v + lodResolution + 2;
-				ptr[count++] = v + 2;
- 
-				ptr[count++] = v + 2;
-				ptr[count++] = v + lodResolution + 2;
-				ptr[count++] = v + lodResolution + 3;
-			}
+	//Triangles are generated row by row, which reloads every vertex of a row
+	//when the next one is drawn, so they are reordered if optimizeIndices is set.
+	//Each set is reordered on its own, so sets keep their ranges
+	indices.assign(lodResolution * lodResolution * 6 * 16, 0);
+	TerrainGrid(lodResolution).GenerateIndices(indices.data(), indicesBufferSize, optimizeIndices);
 
-			ptr[count++] = v;						
-			ptr[count++] = v + lodResolution + 1;	
-			ptr[count++] = v + lodResolution + 2;	
- 
-			ptr[count++] = v;						
-			ptr[count++] = v + lodResolution + 2;	
-			ptr[count++] = v + 2;					
+	//Node vertices are addressed by 16 bits for resolutions up to 255
+	indexSize = GetNodeVerticesCount() <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+	if (uploader)
+	{
+		if (indexSize == sizeof(uint16_t))
+		{
+			vector<uint16_t> shortIndices(indices.begin(), indices.end());
+			uploader->UploadIndices(shortIndices.data(), shortIndices.size(), indexSize);
 		}
 		else
-		{
-			v = 0;
-			ptr[count++] = v;						
-			ptr[count++] = v + 2 + lodResolution;	
-			ptr[count++] = v + 1;					
+			uploader->UploadIndices(indices.data(), indices.size(), indexSize);
+	}
+}
 
-			for (v = 1; v < lodResolution-1 ; v++)
-			{
-				ptr[count++] = v;						
-				ptr[count++] = v + 2 + lodResolution;	
-				ptr[count++] = v + 1;					
- 
-				ptr[count++] = v;						
-				ptr[count++] = v + lodResolution + 1;	
-				ptr[count++] = v + lodResolution + 2;	
-			}
+void Terrain::PrepareIndices()
+{
+	WriteToLog("Generating indices...\n");
+	GenerateIndices();
+	WriteToLog("OK: %d-bit indices, ACMR of full resolution nodes %.3f\n",
+		indexSize * 8, GetIndicesACMR(0));
+}
 
-			ptr[count++] = v;						
-			ptr[count++] = v + 1 + lodResolution;	
-			ptr[count++] = v + 1;					
-		}
-		//
-		//RIGHT SIDE
-		//
-		if(i & TERRAIN_GRID_SPARSE_RIGHT)
+float Terrain::GetIndicesACMR(int i, int cacheSize) const
+{
+	if (indices.empty())
+		return 0.0f;
+	VertexCache cache(cacheSize);
+	return cache.ComputeACMR(&indices[lodResolution * lodResolution * 6 * i], indicesBufferSize[i]);
+}
+
+inline float SegmentDistance(float x, float a, float b)
+{
+	return glm::max(glm::max(a - x, x - b), 0.0f);
+}
+
+inline float NodeMetric(
+	const vec3& viewpoint, const vec3& scale,
+	float left, float right, float upper, float lower,
+	float minHeight, float maxHeight, float error
+	)
+{
+	vec3 rel_pos = scale * vec3(
+		SegmentDistance(viewpoint.x, left, right),
+		SegmentDistance(viewpoint.y, minHeight, maxHeight),
+		SegmentDistance(viewpoint.z, upper, lower)
+		);
+	float e = error * scale.y;
+	return e > 0.0f ? length(rel_pos) / e : FLT_MAX;
+}
+
+bool Terrain::BalanceNodes()
+{
+	//Restore nodes disabled by the previous selection
+	for (const QuadTree<TerrainNode>::Iterator& node : disabledNodes)
+		node->enabled = true;
+	disabledNodes.clear();
+
+	for (const QuadTree<TerrainNode>::Iterator& node : splitNodes)
+	if (node->enabled)
+	{
+		node->enabled = false;
+		disabledNodes.push_back(node);
+	}
+
+	//Disabled nodes also serve as a work queue: parents of neighbours of each
+	//disabled node are disabled too, so neighbouring nodes to draw never differ
+	//by more than one level. Each node is queued once at most.
+	bool balanced = true;
+	for (size_t i = 0; i < disabledNodes.size(); i++)
+	{
+		QuadTree<TerrainNode>::Iterator node = disabledNodes[i];
+		if (!node.Parent())
+			continue;
+		for (int j = 0; j < QTREE_NEIGHBOURS_COUNT; j++)
 		{
-			u = 0;
-			unsigned int aux = u*(lodResolution+1) + lodResolution;
-			ptr[count++] = aux;							  
-			ptr[count++] = aux + lodResolution;			
-			ptr[count++] = aux + 2*lodResolution + 2;	
- 
-			ptr[count++] = aux + lodResolution;			
-			ptr[count++] = aux + 2*lodResolution + 1;	
-			ptr[count++] = aux + 2*lodResolution + 2;	
-
-			for (u = 2; u < lodResolution-2 ; u+=2)
+			QuadTree<TerrainNode>::Iterator neighbour = node.Neighbour(j);
+			if (neighbour && neighbour.Parent()->enabled)
 			{
-				aux = u*(lodResolution+1) + lodResolution;
-				ptr[count++] = aux;
-				ptr[count++] = aux - 1;						
-				ptr[count++] = aux + lodResolution;			
- 
-				ptr[count++] = aux;
-				ptr[count++] = aux + lodResolution;			
-				ptr[count++] = aux + 2*lodResolution + 2;	
- 
-				ptr[count++] = aux + lodResolution;			
-				ptr[count++] = aux + 2*lodResolution + 1;	
-				ptr[count++] = aux + 2*lodResolution + 2;	
+				if (!CanSplit(neighbour.Parent()))
+				{
+					//Coarser neighbour stays whole until its children are streamed in,
+					//so this node can't be split too
+					if (!node->lodBlocked)
+					{
+						node->lodBlocked = true;
+						blockedNodes.push_back(node);
+					}
+					balanced = false;
+					continue;
+				}
+				neighbour.Parent()->enabled = false;
+				disabledNodes.push_back(neighbour.Parent());
 			}
-
-			aux = u*(lodResolution+1) + lodResolution;
-			ptr[count++] = aux;  
-			ptr[count++] = aux - 1;						
-			ptr[count++] = aux + lodResolution;			
- 
-			ptr[count++] = aux; 
-			ptr[count++] = aux + lodResolution;			
-			ptr[count++] = aux + 2*lodResolution + 2;	
 		}
-		else
+	}
+	if (!balanced)
+		return false;
+
+	//Nodes to draw are enabled children of disabled nodes,
+	//their edges adjoining coarser nodes must be sparse
+	renderList.clear();
+	renderInstances.clear();
+	if (heightmap.Heap()->enabled)
+	{
+		heightmap.Heap()->stitchMask = 0;
+		AddToRenderList(heightmap.Heap(), renderList, renderInstances);
+	}
+	for (const QuadTree<TerrainNode>::Iterator& node : disabledNodes)
+	for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+	{
+		QuadTree<TerrainNode>::Iterator child = node.Child(i);
+		if (!child->enabled)
+			continue;
+		int stitchMask = 0;
+		for (int j = 0; j < QTREE_NEIGHBOURS_COUNT; j++)
 		{
-			u = 0;
-			unsigned int aux = u*(lodResolution+1) + lodResolution;
-			ptr[count++] = aux;
-			ptr[count++] = aux + lodResolution;			
-			ptr[count++] = aux + lodResolution + 1;		
+			QuadTree<TerrainNode>::Iterator neighbour = child.Neighbour(j);
+			if (neighbour && neighbour.Parent()->enabled)
+				stitchMask |= (1 << j);
+		}
+		child->stitchMask = stitchMask;
+		AddToRenderList(child, renderList, renderInstances);
+	}
+	return true;
+}
+
+void Terrain::BuildDrawCommands(vector<TerrainDrawCommand>& commands, bool sharedVertices) const
+{
+	const int verticesCount = GetNodeVerticesCount();
+	const vector<TerrainRenderItem>& items = GetRenderList();
+	commands.resize(items.size());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		const TerrainRenderItem& item = items[i];
+		TerrainDrawCommand& command = commands[i];
+		command.count = item.indexCount;
+		command.instanceCount = 1;
+		command.firstIndex = item.firstIndex;
+		command.baseVertex = sharedVertices ? 0 : static_cast<int32_t>(item.node) * verticesCount;
+		command.baseInstance = static_cast<uint32_t>(i);
+	}
+}
+
+void Terrain::AddToRenderList(
+	const QuadTree<TerrainNode>::Iterator& node,
+	vector<TerrainRenderItem>& items,
+	vector<vec3>& instances
+	) const
+{
+	TerrainRenderItem item;
+	item.node = static_cast<uint32_t>(node.Index());
+	item.stitchMask = node->stitchMask;
+	item.firstIndex = lodResolution * lodResolution * 6 * node->stitchMask;
+	item.indexCount = indicesBufferSize[node->stitchMask];
+	items.push_back(item);
+	instances.push_back(vec3(node.OffsetFloat(), 1.0f / node.LayerSize()));
+}
+
+void Terrain::CullNodes()
+{
+	cullStatistics = TerrainCullStatistics();
+	cullStatistics.selectedNodes = static_cast<unsigned int>(renderList.size());
+	if (!culling)
+	{
+		cullStatistics.drawnNodes = cullStatistics.selectedNodes;
+		return;
+	}
+
+	//Planes of the frustum in terrain space, point p is inside if dot(plane, vec4(p, 1)) >= 0
+	mat4 clip = frustumMatrix * GetModelMatrix();
+	vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+	vec4 planes[6] = {
+		rows[3] + rows[0], rows[3] - rows[0],
+		rows[3] + rows[1], rows[3] - rows[1],
+		rows[3] + rows[2], rows[3] - rows[2]
+	};
+	const int allPlanes = (1 << 6) - 1;
 
-			for (u = 1; u < lodResolution-1 ; u++)
+	//Each node goes with the mask of planes its bounds may cross,
+	//drawn nodes are enabled nodes whose parents are disabled
+	visibleList.clear();
+	visibleInstances.clear();
+	cullStack.clear();
+	cullStack.push_back(make_pair(heightmap.Heap(), allPlanes));
+	while (!cullStack.empty())
+	{
+		QuadTree<TerrainNode>::Iterator node = cullStack.back().first;
+		int mask = cullStack.back().second;
+		cullStack.pop_back();
+		if (mask)
+		{
+			cullStatistics.testedNodes++;
+			float sz = static_cast<float>(node.LayerSize());
+			vec3 lowCorner(node.Offset().x / sz, node->heights.x, node.Offset().y / sz);
+			vec3 highCorner((node.Offset().x + 1) / sz, node->heights.y, (node.Offset().y + 1) / sz);
+			bool outside = false;
+			for (int i = 0; i < 6 && !outside; i++)
+			if (mask & (1 << i))
 			{
-				aux = u*(lodResolution+1) + lodResolution;
-				ptr[count++] = aux;							   
-				ptr[count++] = aux - 1;						
-				ptr[count++] = aux + lodResolution;			
- 
-				ptr[count++] = aux; 
-				ptr[count++] = aux + lodResolution;			
-				ptr[count++] = aux + lodResolution + 1;		
+				//Corners of the bounds farthest along the plane normal and against it
+				const vec4& plane = planes[i];
+				vec3 farthest(
+					plane.x > 0.0f ? highCorner.x : lowCorner.x,
+					plane.y > 0.0f ? highCorner.y : lowCorner.y,
+					plane.z > 0.0f ? highCorner.z : lowCorner.z
+					);
+				vec3 nearest(
+					plane.x > 0.0f ? lowCorner.x : highCorner.x,
+					plane.y > 0.0f ? lowCorner.y : highCorner.y,
+					plane.z > 0.0f ? lowCorner.z : highCorner.z
+					);
+				if (dot(vec3(plane), farthest) + plane.w < 0.0f)
+					outside = true;
+				else if (dot(vec3(plane), nearest) + plane.w >= 0.0f)
+					mask &= ~(1 << i);
 			}
-			aux = u*(lodResolution+1) + lodResolution;
-			ptr[count++] = aux;
-			ptr[count++] = aux - 1;						
-			ptr[count++] = aux + lodResolution + 1;
-		}
-		//
-		//LOWER SIDE
-		//
-		if(i & TERRAIN_GRID_SPARSE_LOWER)
-		{
-			v = 0;
-			unsigned int aux = (lodResolution-1)*(lodResolution+1) + v;
-			ptr[count++] = aux + 1;					
-			ptr[count++] = aux + lodResolution + 1;	
-			ptr[count++] = aux + lodResolution + 3;	
- 
-			ptr[count++] = aux + 2;					
-			ptr[count++] = aux + 1;					
-			ptr[count++] = aux + lodResolution + 3;	
-
-			for (v = 2; v < lodResolution-2 ; v+=2)
+			if (outside)
 			{
-				aux = (lodResolution-1)*(lodResolution+1) + v;
-				ptr[count++] = aux + 1;					
-				ptr[count++] = aux;						
-				ptr[count++] = aux + lodResolution + 1;	
- 
-				ptr[count++] = aux + 1;					
-				ptr[count++] = aux + lodResolution + 1;	
-				ptr[count++] = aux + lodResolution + 3;	
- 
-				ptr[count++] = aux + 2;					
-				ptr[count++] = aux + 1;					
-				ptr[count++] = aux + lodResolution + 3;	
+				cullStatistics.outsideSubtrees++;
+				continue;
 			}
-			aux = (lodResolution-1)*(lodResolution+1) + v;
-			ptr[count++] = aux + 1;
-			ptr[count++] = aux;
-			ptr[count++] = aux + lodResolution + 1;
- 
-			ptr[count++] = aux + 1;					
-			ptr[count++] = aux + lodResolution + 1;	
-			ptr[count++] = aux + lodResolution + 3;	
+			if (!mask)
+				cullStatistics.insideSubtrees++;
 		}
-		else
+		if (node->enabled)
 		{
-			v = 0;
-			unsigned int aux = (lodResolution-1)*(lodResolution+1) + v;
-			ptr[count++] = aux + 1;					
-			ptr[count++] = aux + lodResolution + 1;	
-			ptr[count++] = aux + lodResolution + 2;	
+			AddToRenderList(node, visibleList, visibleInstances);
+			continue;
+		}
+		for (int i = QTREE_CHILDREN_COUNT - 1; i >= 0; i--)
+			cullStack.push_back(make_pair(node.Child(i), mask));
+	}
+	cullStatistics.drawnNodes = static_cast<unsigned int>(visibleList.size());
+}
 
-			for (v = 1; v < lodResolution-1 ; v++)
-			{
-				aux = (lodResolution-1)*(lodResolution+1) + v;
-				ptr[count++] = aux + 1;					
-				ptr[count++] = aux;						
-				ptr[count++] = aux + lodResolution + 1;	
- 
-				ptr[count++] = aux + 1;					
-				ptr[count++] = aux + lodResolution + 1;	
-				ptr[count++] = aux + lodResolution + 2;	
-			}
-			aux = (lodResolution - 1)*(lodResolution + 1) + v;
-			ptr[count++] = aux;
-			ptr[count++] = aux + lodResolution + 1;
-			ptr[count++] = aux + lodResolution + 2;
+float Terrain::GetMorphFactor(const QuadTree<TerrainNode>::Iterator& node, const vec3& viewpoint) const
+{
+	return GetMorphFactor(node, viewpoint, GetLODThreshold());
+}
+
+float Terrain::GetMorphFactor(const QuadTree<TerrainNode>::Iterator& node, const vec3& viewpoint, float threshold) const
+{
+	//Parent replaces the node when its metric exceeds the threshold,
+	//the node morphs over morphRange of the threshold before that
+	if (!(morphRange > 0.0f) || !node.Parent())
+		return 0.0f;
+	QuadTree<TerrainNode>::Iterator parent = node.Parent();
+	float sz = static_cast<float>(parent.LayerSize());
+	float metric = NodeMetric(
+		viewpoint, scale,
+		parent.Offset().x / sz, (parent.Offset().x + 1) / sz,
+		parent.Offset().y / sz, (parent.Offset().y + 1) / sz,
+		parent->heights.x, parent->heights.y, parent->error
+		);
+	return clamp((metric / threshold - 1.0f + morphRange) / morphRange, 0.0f, 1.0f);
+}
+
+void Terrain::MorphNodes(const vec3& viewpoint)
+{
+	//Factors of all selected nodes are needed, culled neighbours share edges too
+	float threshold = GetLODThreshold();
+	vector<TerrainNode>& nodes = heightmap.GetNodes();
+	for (const TerrainRenderItem& item : renderList)
+		nodes[item.node].morphFactor = GetMorphFactor(heightmap.Node(item.node), viewpoint, threshold);
+
+	const vector<TerrainRenderItem>& items = GetRenderList();
+	renderMorphs.resize(items.size());
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		QuadTree<TerrainNode>::Iterator node = heightmap.Node(items[i].node);
+		TerrainNodeMorph& morph = renderMorphs[i];
+		morph.factor = node->morphFactor;
+		//Edges adjoining drawn nodes of the same level morph like the less morphed node,
+		//edges adjoining coarser or finer nodes keep heights the stitching relies on
+		for (int j = 0; j < QTREE_NEIGHBOURS_COUNT; j++)
+		{
+			QuadTree<TerrainNode>::Iterator neighbour = node.Neighbour(j);
+			if (!neighbour)
+				morph.edges[j] = morph.factor;
+			else if (neighbour->enabled && !neighbour.Parent()->enabled)
+				morph.edges[j] = glm::min(morph.factor, neighbour->morphFactor);
+			else
+				morph.edges[j] = 0.0f;
 		}
-		//
-		//LEFT SIDE
-		//
-		if(i & TERRAIN_GRID_SPARSE_LEFT)
+	}
+}
+
+void Terrain::LODLayer::Clear()
+{
+	nodes.clear();
+	left.clear(); right.clear();
+	upper.clear(); lower.clear();
+	minHeight.clear(); maxHeight.clear();
+	error.clear();
+}
+
+void Terrain::LODLayer::Add(const QuadTree<TerrainNode>::Iterator& node)
+{
+	float sz = static_cast<float>(node.LayerSize());
+	nodes.push_back(node);
+	left.push_back(node.Offset().x / sz);
+	right.push_back((node.Offset().x + 1) / sz);
+	upper.push_back(node.Offset().y / sz);
+	lower.push_back((node.Offset().y + 1) / sz);
+	minHeight.push_back(node->heights.x);
+	maxHeight.push_back(node->heights.y);
+	error.push_back(node->error);
+}
+
+void Terrain::LODLayer::ComputeMetric(const vec3& viewpoint, const vec3& scale)
+{
+	//World space distance from the viewpoint to node bounds divided by world space error,
+	//nodes without error are never split
+	size_t count = nodes.size(), i = 0;
+	metric.resize(count);
+#ifdef TERRAIN_USE_SSE
+	const __m128 vx = _mm_set1_ps(viewpoint.x);
+	const __m128 vy = _mm_set1_ps(viewpoint.y);
+	const __m128 vz = _mm_set1_ps(viewpoint.z);
+	const __m128 sx = _mm_set1_ps(scale.x);
+	const __m128 sy = _mm_set1_ps(scale.y);
+	const __m128 sz = _mm_set1_ps(scale.z);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 never = _mm_set1_ps(FLT_MAX);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 l = _mm_loadu_ps(&left[i]), r = _mm_loadu_ps(&right[i]);
+		__m128 u = _mm_loadu_ps(&upper[i]), d = _mm_loadu_ps(&lower[i]);
+		__m128 hmin = _mm_loadu_ps(&minHeight[i]), hmax = _mm_loadu_ps(&maxHeight[i]);
+		__m128 e = _mm_mul_ps(_mm_loadu_ps(&error[i]), sy);
+		__m128 x = _mm_mul_ps(_mm_max_ps(_mm_max_ps(_mm_sub_ps(l, vx), _mm_sub_ps(vx, r)), zero), sx);
+		__m128 y = _mm_mul_ps(_mm_max_ps(_mm_max_ps(_mm_sub_ps(hmin, vy), _mm_sub_ps(vy, hmax)), zero), sy);
+		__m128 z = _mm_mul_ps(_mm_max_ps(_mm_max_ps(_mm_sub_ps(u, vz), _mm_sub_ps(vz, d)), zero), sz);
+		__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		__m128 valid = _mm_cmpgt_ps(e, zero);
+		__m128 m = _mm_or_ps(_mm_and_ps(valid, _mm_div_ps(len, e)), _mm_andnot_ps(valid, never));
+		_mm_storeu_ps(&metric[i], m);
+	}
+#endif
+	for (; i < count; i++)
+		metric[i] = NodeMetric(viewpoint, scale, left[i], right[i], upper[i], lower[i], minHeight[i], maxHeight[i], error[i]);
+}
+
+void Terrain::RenewNodes(const vec3& viewpoint)
+{
+	if (IsCaching())
+		BeginCacheFrame();
+
+	//Viewpoint in the terrain space is the same for all nodes
+	vec3 rel_viewpoint = vec3(inverse(GetModelMatrix()) * vec4(viewpoint, 1.0f));
+	float threshold = GetLODThreshold();
+
+	//Selection is repeated only if balancing has blocked some nodes while caching
+	do
+	{
+		//Nodes are checked layer by layer, split nodes pass their children to the next layer
+		splitNodes.clear();
+		LODLayer* layer = &lodLayers[0];
+		LODLayer* next = &lodLayers[1];
+		layer->Clear();
+		layer->Add(heightmap.Heap());
+		while (!layer->nodes.empty())
 		{
-			u = 0;
-			unsigned int aux = u*(lodResolution+1);
-			ptr[count++] = aux; 
-			ptr[count++] = aux + 2*lodResolution + 2;	
-			ptr[count++] = aux + lodResolution + 2;		
- 
-			ptr[count++] = aux + lodResolution + 2;		
-			ptr[count++] = aux + 2*lodResolution + 2;	
-			ptr[count++] = aux + 2*lodResolution + 3;	
-
-			for (u = 2; u < lodResolution-2 ; u+=2)
+			visitedNodesCount += layer->nodes.size();
+			//Nodes of the most detailed layer are always enabled
+			if (layer->nodes.front().Level() == maxLOD)
+				break;
+
+			layer->ComputeMetric(rel_viewpoint, scale);
+			next->Clear();
+			for (size_t i = 0; i < layer->nodes.size(); i++)
+			if (!(layer->metric[i] > threshold) && CanSplit(layer->nodes[i]))
 			{
-				aux = u*(lodResolution+1);
-				ptr[count++] = aux + 1;
-				ptr[count++] = aux;						
-				ptr[count++] = aux + lodResolution + 2;		
- 
-				ptr[count++] = aux; 
-				ptr[count++] = aux + 2*lodResolution + 2;	
-				ptr[count++] = aux + lodResolution + 2;		
- 
-				ptr[count++] = aux + lodResolution + 2;		
-				ptr[count++] = aux + 2*lodResolution + 2;	
-				ptr[count++] = aux + 2*lodResolution + 3;	
+				//This node is not enabled
+				//continue checking its children
+				const QuadTree<TerrainNode>::Iterator& node = layer->nodes[i];
+				splitNodes.push_back(node);
+				next->Add(node.Child(1));
+				next->Add(node.Child(0));
+				next->Add(node.Child(3));
+				next->Add(node.Child(2));
 			}
+			swap(layer, next);
+		}
+	} while (!BalanceNodes());
 
-			aux = u*(lodResolution+1);
-			ptr[count++] = aux + 1;
-			ptr[count++] = aux;						
-			ptr[count++] = aux + lodResolution + 2;		
- 
-			ptr[count++] = aux; 
-			ptr[count++] = aux + 2*lodResolution + 2;	
-			ptr[count++] = aux + lodResolution + 2;		
+	if (IsCaching())
+		RequestNodes(rel_viewpoint);
+	CullNodes();
+	MorphNodes(rel_viewpoint);
+}
+
+void Terrain::Update(const vec3& viewpoint)
+{
+	//Distance travelled since which the state is rebased to keep float precision
+	const float maxTravelled = 64.0f;
+
+	mat4 inverseModel = inverse(GetModelMatrix());
+	vec3 rel_viewpoint = vec3(inverseModel * vec4(viewpoint, 1.0f));
+	float threshold = GetLODThreshold();
+	//World space distance changes not faster than the viewpoint moves times the largest scale
+	float maxScale = glm::max(glm::max(abs(scale.x), abs(scale.y)), abs(scale.z));
+
+	//Previous decisions are valid only while the terrain stays in place and the view is the same
+	bool changed = false;
+	if (!lodStateValid || inverseModel != lodInverseModel || threshold != lodThreshold)
+	{
+		for (TerrainNode& node : heightmap.GetNodes())
+		{
+			node.split = false;
+			node.lodExpiry = -1.0f;
 		}
-		else
+		lodTravelled = 0.0f;
+		lodInverseModel = inverseModel;
+		lodThreshold = threshold;
+		lodStateValid = true;
+		changed = true;
+	}
+	else
+		lodTravelled += distance(rel_viewpoint, lodViewpoint);
+	lodViewpoint = rel_viewpoint;
+
+	if (lodTravelled > maxTravelled)
+	{
+		for (TerrainNode& node : heightmap.GetNodes())
+			node.lodExpiry -= lodTravelled;
+		lodTravelled = 0.0f;
+	}
+
+	//New resident nodes may change the selection
+	if (IsCaching() && BeginCacheFrame())
+		changed = true;
+
+	visitedNodesCount = 0;
+	reevaluatedNodesCount = 0;
+	for (;;)
+	{
+		splitNodes.clear();
+
+		//Walk through the previous selection layer by layer, like RenewNodes does
+		vector<QuadTree<TerrainNode>::Iterator>* layer = &lodLayers[0].nodes;
+		vector<QuadTree<TerrainNode>::Iterator>* next = &lodLayers[1].nodes;
+		layer->assign(1, heightmap.Heap());
+		while (!layer->empty())
 		{
-			u = 0;
-			unsigned int aux = u*(lodResolution+1);
-			ptr[count++] = aux; 
-			ptr[count++] = aux + lodResolution + 1;		
-			ptr[count++] = aux + lodResolution + 2;		
+			visitedNodesCount += layer->size();
+			if (layer->front().Level() == maxLOD)
+				break;
 
-			for (u = 1; u < lodResolution-1 ; u++)
+			//Distance to node bounds changes not faster than the viewpoint moves,
+			//so the decision is checked again only when the viewpoint has travelled
+			//farther than the margin between that distance and the threshold one
+			lodCheckedLayer.Clear();
+			for (const QuadTree<TerrainNode>::Iterator& node : *layer)
+				if (node->lodExpiry <= lodTravelled)
+					lodCheckedLayer.Add(node);
+			lodCheckedLayer.ComputeMetric(rel_viewpoint, scale);
+			reevaluatedNodesCount += lodCheckedLayer.nodes.size();
+			for (size_t i = 0; i < lodCheckedLayer.nodes.size(); i++)
 			{
-				aux = u*(lodResolution+1);
-				ptr[count++] = aux;
-				ptr[count++] = aux + lodResolution + 2;		
-				ptr[count++] = aux + 1;						
- 
-				ptr[count++] = aux;  
-				ptr[count++] = aux + lodResolution + 1;		
-				ptr[count++] = aux + lodResolution + 2;		
+				const QuadTree<TerrainNode>::Iterator& node = lodCheckedLayer.nodes[i];
+				float metric = lodCheckedLayer.metric[i];
+				bool split = !(metric > threshold);
+				float error = lodCheckedLayer.error[i] * scale.y;
+				float margin = error > 0.0f ? abs(metric - threshold) * error / maxScale : FLT_MAX;
+				changed = changed || split != node->split;
+				node->split = split;
+				node->lodExpiry = lodTravelled + 0.99f * margin;
 			}
-			aux = u*(lodResolution+1);
-			ptr[count++] = aux;							   
-			ptr[count++] = aux + lodResolution + 1;		
-			ptr[count++] = aux + 1;						
-		}
-		//
-		//CENTRAL PART
-		//
-		for (u = 1; u < lodResolution-1; u++)
-		{
-			for (v = 1; v < lodResolution-1 ; v++)
+
+			next->clear();
+			for (const QuadTree<TerrainNode>::Iterator& node : *layer)
+			if (node->split && CanSplit(node))
 			{
-				const unsigned int aux = u*(lodResolution+1) + v;
-				ptr[count++] = aux;						
-				ptr[count++] = aux + 2 + lodResolution;	
-				ptr[count++] = aux + 1;					
- 
-				ptr[count++] = aux;						
-				ptr[count++] = aux + lodResolution + 1;	
-				ptr[count++] = aux + lodResolution + 2;	
+				splitNodes.push_back(node);
+				next->push_back(node.Child(1));
+				next->push_back(node.Child(0));
+				next->push_back(node.Child(3));
+				next->push_back(node.Child(2));
 			}
+			swap(layer, next);
 		}
-		indicesBufferSize[i] = count;
+
+		//Enabled nodes are rebuilt only when the selection has changed,
+		//selection is repeated if balancing has blocked some nodes while caching
+		if (!changed || BalanceNodes())
+			break;
 	}
 
-	glGenBuffers(1, &indicesBufferID);
+	if (IsCaching())
+		RequestNodes(rel_viewpoint);
+	CullNodes();
+	MorphNodes(rel_viewpoint);
+}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesBufferID);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, VBOSize * sizeof(uint32), indices.data(), GL_STATIC_DRAW);
+bool Terrain::BeginCacheFrame()
+{
+	nodeCache.NextFrame();
+	ReceiveLoadedNodes();
+	if (!nodesArrived)
+		return false;
+	nodesArrived = false;
 
-	OPENGL_CHECK_FOR_ERRORS();
+	//Blocked nodes may be split with the new nodes
+	for (const QuadTree<TerrainNode>::Iterator& node : blockedNodes)
+		node->lodBlocked = false;
+	blockedNodes.clear();
+	return true;
 }
 
-inline float ClosestSegmentPoint(float x, float a, float b)
+bool Terrain::CanSplit(const QuadTree<TerrainNode>::Iterator& node)
 {
-	return min(abs(x - a), abs(x - b));
+	if (!IsCaching())
+		return true;
+	if (node->lodBlocked)
+		return false;
+	//Resident children are kept while they wait for their siblings.
+	//Node stays wanted while its children are pending, so their requests aren't stale
+	bool resident = true;
+	for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+		if (!nodeCache.Lookup(*node.Child(i)))
+			resident = false;
+	if (!resident)
+		streamWanted.push_back(node);
+	return resident;
 }
 
-void Terrain::DisableNodes(const QuadTree<TerrainNode>::Iterator& node)
+void Terrain::ReceiveLoadedNodes()
 {
-	if (node->enabled)
+	loadScheduler.Collect(loadedNodes);
+	for (TerrainLoadedNode& loaded : loadedNodes)
 	{
-		node->enabled = false;
-		if (node.Parent())
+		streamPendingCount--;
+		QuadTree<TerrainNode>::Iterator node = heightmap.Node(loaded.index);
+		node->requested = false;
+		if (!loaded.loaded)
 		{
-			for (int i = 0; i < QTREE_NEIGHBOURS_COUNT; i++)
-			if (node.Neighbour(i) && node.Neighbour(i).Parent())
-			{
-				DisableNodes(node.Neighbour(i).Parent());
-			}
+			//Node isn't requested again, so its parent stays drawn
+			WriteToLog("ERROR: Failed to load node %s of terrain\n", ToString(loaded.index).c_str());
+			node->loadFailed = true;
+			continue;
 		}
+		//Parent could be evicted while the node was loaded,
+		//resident nodes always have resident parents
+		if (!node.Parent()->resident)
+			continue;
+		MakeResident(node, loaded.vertices, loaded.colors, loaded.morphTargets);
 	}
+	if (uploader && !loadedNodes.empty())
+		uploader->FlushUploads();
+	loadScheduler.Recycle(loadedNodes);
 }
 
-void Terrain::EnableNodes(const QuadTree<TerrainNode>::Iterator& node)
+void Terrain::RequestNodes(const vec3& viewpoint)
 {
-	node->enabled = true;
-	for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+	//Nodes of the current selection are in use
+	vector<TerrainNode>& nodes = heightmap.GetNodes();
+	for (const TerrainRenderItem& item : renderList)
+		nodeCache.Touch(nodes[item.node]);
+	for (const QuadTree<TerrainNode>::Iterator& node : disabledNodes)
+		nodeCache.Touch(*node);
+
+	//Children of nodes to split are wanted, a node is wanted once even if it was checked
+	//several times. Nodes with larger projected error are more urgent, like in LOD selection,
+	//and coarser nodes go first if the metric is equal
+	sort(streamWanted.begin(), streamWanted.end(),
+		[](const QuadTree<TerrainNode>::Iterator& a, const QuadTree<TerrainNode>::Iterator& b) { return a.Index() < b.Index(); });
+	streamWanted.erase(unique(streamWanted.begin(), streamWanted.end()), streamWanted.end());
+	wantedLayer.Clear();
+	for (const QuadTree<TerrainNode>::Iterator& node : streamWanted)
+		wantedLayer.Add(node);
+	wantedLayer.ComputeMetric(viewpoint, scale);
+	wantedOrder.clear();
+	for (size_t i = 0; i < wantedLayer.nodes.size(); i++)
+		wantedOrder.push_back(make_pair(wantedLayer.metric[i], i));
+	sort(wantedOrder.begin(), wantedOrder.end());
+
+	//Queued requests of wanted nodes get new priorities,
+	//requests which aren't wanted anymore are cancelled
+	loadScheduler.NextFrame();
+	size_t wantedCount = 0;
+	for (const pair<float, size_t>& wanted : wantedOrder)
+		for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+		{
+			QuadTree<TerrainNode>::Iterator child = wantedLayer.nodes[wanted.second].Child(i);
+			if (child->requested)
+				loadScheduler.Reprioritize(child.Index(), -wanted.first);
+			else if (!child->resident && !child->loadFailed)
+				wantedCount++;
+		}
+	loadScheduler.CancelStale(cancelledNodes);
+	for (size_t index : cancelledNodes)
 	{
-		if (node.Child(i))
-			EnableNodes(node.Child(i));
+		nodes[index].requested = false;
+		streamPendingCount--;
+	}
+	cancelledNodes.clear();
 
+	//Make room for wanted nodes: evict unused nodes without resident children,
+	//least recently used first. Root is never evicted
+	size_t capacity = nodeCache.GetCapacity();
+	size_t demand = nodeCache.GetResidentNodes().size() + streamPendingCount + wantedCount;
+	if (demand > capacity)
+		nodeCache.Evict(demand - capacity, nodes,
+			[&](size_t index) {
+				QuadTree<TerrainNode>::Iterator node = heightmap.Node(index);
+				if (!node.Parent())
+					return false;
+				if (node.Level() < maxLOD)
+					for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+						if (node.Child(i)->resident)
+							return false;
+				return true;
+			},
+			[&](TerrainNode& node) {
+				if (uploader)
+					uploader->UnloadNode(node);
+			});
+
+	//Children are requested together, so the budget isn't spent on incomplete sets.
+	//Parent stays drawn until all of them are resident
+	for (const pair<float, size_t>& wanted : wantedOrder)
+	{
+		const QuadTree<TerrainNode>::Iterator& node = wantedLayer.nodes[wanted.second];
+		size_t missing = 0;
+		bool failed = false;
+		for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+		{
+			if (!node.Child(i)->resident && !node.Child(i)->requested)
+				missing++;
+			failed = failed || node.Child(i)->loadFailed;
+		}
+		//Set with a failed child can't be completed
+		if (failed || missing == 0 || nodeCache.GetResidentNodes().size() + streamPendingCount + missing > capacity)
+			continue;
+		for (int i = 0; i < QTREE_CHILDREN_COUNT; i++)
+		{
+			QuadTree<TerrainNode>::Iterator child = node.Child(i);
+			if (child->resident || child->requested)
+				continue;
+			child->requested = true;
+			loadScheduler.Submit(child.Index(), -wanted.first);
+			streamPendingCount++;
+		}
 	}
+	streamWanted.clear();
 }
 
-void Terrain::RenewNodes(const vec3& viewpoint, const QuadTree<TerrainNode>::Iterator& node)
+bool Terrain::LoadNode(size_t index, vector<vec3>& vertices, vector<vec3>& colors, vector<vec2>& morphTargets)
 {
-	//Check if this node must be enabled using morph-factor
-	float sz = static_cast<float>(node.LayerSize());
-	float l = node.Offset().x / sz, r = (node.Offset().x + 1) / sz;
-	float u = node.Offset().y / sz, d = (node.Offset().y + 1) / sz;
-	vec3 rel_pos = vec3(inverse(GetModelMatrix()) * vec4(viewpoint, 1.0f));
-	rel_pos.x = ClosestSegmentPoint(rel_pos.x, l, r);
-	rel_pos.y = ClosestSegmentPoint(rel_pos.y, node->heights.x, node->heights.y);
-	rel_pos.z = ClosestSegmentPoint(rel_pos.z, u, d);
-	if (length(rel_pos)*length(rel_pos) / 
-		(1.0f + node->heights.y - node->heights.x) / 
-		(r - l) / (d - u) > 5.0f || 
-		node.Level() == maxLOD)
-	{
-		//This node is probably enabled
+	if (index >= heightmap.GetNodes().size())
+		return false;
+	QuadTree<TerrainNode>::Iterator node = heightmap.Node(index);
+	if (IsStreaming())
+	{
+		const TerrainStreamHeader& header = stream.GetHeader();
+		BuildNodeVertices(
+			node,
+			stream.GetNodeHeights(index),
+			vec2(header.heightMin, header.heightMax),
+			vertices,
+			colors
+			);
 	}
 	else
 	{
-		//This node is not enabled
-		//continue checking its children
-		DisableNodes(node);
-		RenewNodes(viewpoint, node.Child(1));
-		RenewNodes(viewpoint, node.Child(0));
-		RenewNodes(viewpoint, node.Child(3));
-		RenewNodes(viewpoint, node.Child(2));
+		//Node keeps the height range of its subtree computed at loading
+		BuildNodeVertices(node, cacheHeightmap, vertices, colors);
 	}
+	BuildMorphTargets(vertices, morphTargets);
+	return true;
+}
+
+void Terrain::MakeResident(
+	const QuadTree<TerrainNode>::Iterator& node,
+	const vector<vec3>& vertices,
+	const vector<vec3>& colors,
+	const vector<vec2>& morphTargets
+	)
+{
+	if (uploader)
+		uploader->UploadNode(node.Index(), *node, vertices, colors, morphTargets);
+	nodeCache.Insert(node.Index(), *node);
+	nodesArrived = true;
 }
@@ -10,27 +10,108 @@
 #include "Camera.h"
 #include "DenseQuadTree.h"
 #include "TGALoader.h"
+#include "HeightGrid.h"
+#include "HeightmapReader.h"
+#include "TerrainUploader.h"
+#include "TerrainStream.h"
+#include "TerrainNodeCache.h"
+#include "TerrainLoadScheduler.h"
+#include "TerrainGrid.h"
 #include <vector>
 
-#define TERRAIN_GRID_SPARSE_UPPER 8
-#define TERRAIN_GRID_SPARSE_RIGHT 4
-#define TERRAIN_GRID_SPARSE_LOWER 2
-#define TERRAIN_GRID_SPARSE_LEFT 1
-
 #define DEFAULT_LOD_RESOLUTION 32
 #define DEFAULT_LOD_MAXIMUM 6
+//Screen-space error of LOD selection: tolerance in pixels and view used until it is set
+#define DEFAULT_PIXEL_TOLERANCE 2.0f
+#define DEFAULT_VIEW_FOV 45.0f
+#define DEFAULT_VIEWPORT_HEIGHT 720.0f
+//Smaller geometric errors come from rounding of interpolated heights and are ignored
+#define TERRAIN_ERROR_EPSILON 1e-6f
+//Part of the LOD threshold before merging of a node's parent, over which the node
+//morphs to the parent's shape
+#define DEFAULT_MORPH_RANGE 0.3f
+
+//Number of nodes per loading thread generated in parallel while the previous batch
+//is uploaded, small batches keep staging memory in cache
+#define TERRAIN_LOAD_BATCH_PER_THREAD 16
+//Minimal number of resident nodes while caching: root and its children
+#define TERRAIN_STREAM_MIN_RESIDENT 5
+//Default number of threads generating nodes of the node cache
+#define TERRAIN_CACHE_LOAD_THREADS 2
 
 #pragma once
 
 struct TerrainNode
 {
 public:
-	GLuint vaoID = NULL;
-	GLuint vboID[2];
+	//Handles of GPU data, managed by TerrainUploader
+	unsigned int vaoID = 0;
+	unsigned int vboID[3];
 
 	vec2 heights;
+	//Geometric error: the largest vertical distance between the heightmap and triangles
+	//of the node grid, not less than errors of its children. Zero if children add nothing
+	float error = 0.0f;
+
+	bool enabled = true;
+
+	//State of incremental LOD selection:
+	//last split decision and travelled distance after which it must be checked again
+	bool split = false;
+	float lodExpiry = -1.0f;
+	//Edges adjoining coarser nodes if the node is drawn, set by balancing
+	uint32_t stitchMask = 0;
+	//Morph factor if the node is drawn, set for every frame
+	float morphFactor = 0.0f;
+
+	//State of node cache: vertex data is loaded, its loading is requested,
+	//its loading failed and it isn't requested again,
+	//node can't be split until new data arrives, last frame when the node was used
+	bool resident = true;
+	bool requested = false;
+	bool loadFailed = false;
+	bool lodBlocked = false;
+	unsigned int lastUsedFrame = 0;
+};
+
+//Node to draw, prepared by LOD selection
+struct TerrainRenderItem
+{
+	uint32_t node;       //index of the node in the heightmap storage
+	uint32_t stitchMask; //edges adjoining coarser nodes, combination of TERRAIN_GRID_SPARSE_* bits
+	uint32_t firstIndex; //offset of the indices set in the index buffer
+	uint32_t indexCount;
+};
 
-	bool enabled;
+//Geomorphing of a node to draw: vertices move from their heights to the heights of
+//the parent grid by the factor of the node. Vertices on edges use factors of the edges,
+//which are equal in both adjoining nodes, so the mesh stays watertight
+struct TerrainNodeMorph
+{
+	float factor;
+	float edges[4]; //in the order of node neighbours and TERRAIN_GRID_SPARSE_* bits
+};
+
+//Frustum culling of the last call of Renew or Update
+struct TerrainCullStatistics
+{
+	unsigned int selectedNodes = 0;   //nodes chosen by LOD selection
+	unsigned int drawnNodes = 0;      //selected nodes intersecting the frustum
+	unsigned int testedNodes = 0;     //nodes whose bounds were tested against frustum planes
+	unsigned int insideSubtrees = 0;  //subtrees accepted without further tests
+	unsigned int outsideSubtrees = 0; //subtrees rejected at once
+
+	unsigned int GetCulledNodes() const { return selectedNodes - drawnNodes; }
+};
+
+//Indirect draw command, layout matches DrawElementsIndirectCommand of OpenGL
+struct TerrainDrawCommand
+{
+	uint32_t count;
+	uint32_t instanceCount;
+	uint32_t firstIndex;
+	int32_t baseVertex;
+	uint32_t baseInstance;
 };
 
 class Terrain
@@ -42,8 +123,38 @@ public:
 	
 	//Get model matrix
 	mat4 GetModelMatrix() const;
-	//Load heightmap from image file
+	//Load heightmap from TGA, 16-bit or float raw or PGM file, the whole heightmap is loaded to memory
 	bool LoadFromFile(const string& filename);
+	//Load heightmap already stored in memory
+	bool LoadFromHeights(const HeightGrid& hmap);
+	//Load heightmap from the first channel of the image
+	bool LoadFromImage(const Image& img);
+	//Write loaded terrain as pyramid file for streaming, hmap is the loaded heightmap
+	bool SaveStream(const string& filename, const HeightGrid& hmap);
+	//Write pyramid file for streaming from the heightmap read by the reader, which doesn't
+	//have to fit in memory: only the rows covered by one row of the finest nodes are kept.
+	//Finest nodes are built from these rows, coarser ones are reduced from their children:
+	//errors are bounded by errors of children plus their distance to the parent grid,
+	//so they are not less than errors computed from the whole heightmap.
+	//Previous terrain is unloaded, nodes are unloaded afterwards too
+	bool SaveStream(const string& filename, HeightmapReader& reader);
+	//Open pyramid file for streaming: the file is mapped to memory and only bounds
+	//of nodes are read at once, node pages are read on demand by loading threads
+	//when LOD selection needs them, at most budget bytes of node vertex data are
+	//kept resident. lodResolution and maxLOD are taken from the file
+	bool OpenStream(const string& filename, size_t budget);
+	bool IsStreaming() const { return stream.IsOpen(); }
+	//Only a part of nodes is resident, either streamed or with nodeCacheBudget set
+	bool IsCaching() const { return nodeCache.IsEnabled(); }
+	//Node cache statistics
+	size_t GetResidentNodesCount() const { return nodeCache.GetResidentNodes().size(); }
+	size_t GetCacheCapacity() const { return nodeCache.GetCapacity(); }
+	size_t GetPendingNodesCount() const { return streamPendingCount; }
+	const TerrainCacheStatistics& GetCacheStatistics() const { return nodeCache.GetStatistics(); }
+	void ResetCacheStatistics() { nodeCache.ResetStatistics(); loadScheduler.ResetStatistics(); }
+	//Statistics of node loads while caching, latency is in milliseconds
+	TerrainLoadStatistics GetLoadStatistics() const { return loadScheduler.GetStatistics(); }
+	double GetLoadLatencyPercentile(double p) const { return loadScheduler.GetLatencyPercentile(p); }
 
 	//Position, orientation and scale in 3D-space
 	vec3 position;
@@ -53,46 +164,269 @@ public:
 	int lodResolution;
 	int maxLOD;
 
-	float GetMorphFactor(Camera* cam);
+	//Morph factor of a node for the viewpoint in terrain space: 0 far from merging
+	//to the parent, 1 when the parent is about to replace the node
+	float GetMorphFactor(const QuadTree<TerrainNode>::Iterator& node, const vec3& viewpoint) const;
 	int GetHmapResolution() const
 	{
 		return lodResolution * pow(2, maxLOD) + 1;
 	}
-	GLuint GetIndicesBufferID() const { return indicesBufferID; }
+	const vector<uint32_t>& GetIndices() const { return indices; }
 	int GetIndicesBufferSize(int i) const { return indicesBufferSize[i]; }
+	//Bytes of each index uploaded: 2 if node vertices are addressed by 16 bits, else 4
+	int GetIndexSize() const { return indexSize; }
+	//Average cache misses per triangle of a set of indices for a FIFO cache of cacheSize vertices
+	float GetIndicesACMR(int i, int cacheSize = VERTEX_CACHE_SIZE) const;
 	void Renew(const vec3& viewpoint) 
 	{ 
-		EnableNodes(heightmap.Heap()); 
-		RenewNodes(viewpoint, heightmap.Heap()); 
+		visitedNodesCount = 0;
+		lodStateValid = false;
+		RenewNodes(viewpoint); 
 	}
+	//Incremental version of Renew: keeps the previous selection and checks
+	//only nodes whose decision could change since the camera moved
+	void Update(const vec3& viewpoint);
+	//View frustum of the camera given by its view-projection matrix (world to clip space).
+	//While it is set, Renew and Update leave only the nodes intersecting it in the render list,
+	//LOD selection and residency of nodes don't depend on it
+	void SetFrustum(const mat4& viewProjection) { frustumMatrix = viewProjection; culling = true; }
+	void ResetFrustum() { culling = false; }
+	bool IsCulling() const { return culling; }
+	const TerrainCullStatistics& GetCullStatistics() const { return cullStatistics; }
+	//Nodes to draw with the current selection
+	const vector<TerrainRenderItem>& GetRenderList() const { return culling ? visibleList : renderList; }
+	//Placement of the render list nodes in terrain space: offset and size
+	const vector<vec3>& GetRenderInstances() const { return culling ? visibleInstances : renderInstances; }
+	//Geomorphing of the render list nodes, updated by every Renew and Update
+	const vector<TerrainNodeMorph>& GetRenderMorphs() const { return renderMorphs; }
+	//Make draw commands for the render list, assuming that vertices of all nodes
+	//are packed in one buffer in the heightmap storage order.
+	//i-th command draws instance i, so the placement of i-th node of the render list
+	//is available as instance data. If vertices are shared, all nodes use the same grid
+	void BuildDrawCommands(vector<TerrainDrawCommand>& commands, bool sharedVertices = false) const;
+	//Number of vertices of each node
+	int GetNodeVerticesCount() const { return (lodResolution + 1) * (lodResolution + 1); }
+	//Bytes of vertex data generated for each node: positions, colors and morph targets
+	size_t GetNodeVertexBytes() const { return GetNodeVerticesCount() * (2 * sizeof(vec3) + sizeof(vec2)); }
+	//Number of nodes checked by the last call of Renew or Update
+	unsigned int GetVisitedNodesCount() const { return visitedNodesCount; }
+	//Number of nodes whose LOD metric was computed by the last call of Update
+	unsigned int GetReevaluatedNodesCount() const { return reevaluatedNodesCount; }
 	void Unload();
 
+	//Generate sixteen versions of index arrays for each case of sparse/dense egdes,
+	//triangles of each are reordered for the vertex cache if optimizeIndices is set
+	void GenerateIndices();
+	//Generate vertex data of a single node, returns range of its heights
+	vec2 BuildNodeVertices(
+		const QuadTree<TerrainNode>::Iterator& node,
+		const HeightGrid& hmap,
+		vector<vec3>& vertices,
+		vector<vec3>& colors
+		) const;
+	//Generate vertex data of a single node from its heights quantized in pyramid
+	//to the heightRange
+	void BuildNodeVertices(
+		const QuadTree<TerrainNode>::Iterator& node,
+		const uint16_t* heights,
+		vec2 heightRange,
+		vector<vec3>& vertices,
+		vector<vec3>& colors
+		) const;
+	//Generate morph targets of node vertices: x is the height of the parent grid
+	//at the vertex, y is its edge as the neighbour index or TERRAIN_MORPH_INNER
+	void BuildMorphTargets(const vector<vec3>& vertices, vector<vec2>& morphTargets) const;
+	//Compute range of heights of a single node without generating its vertices,
+	//and its own geometric error if error isn't null
+	vec2 BuildNodeHeights(
+		const QuadTree<TerrainNode>::Iterator& node,
+		const HeightGrid& hmap,
+		float* error = nullptr
+		) const;
+	//Compute the largest vertical distance between heightmap samples covered by the node
+	//and triangles of its grid. Heights of grid vertices go in vertex order, stride floats apart
+	float ComputeNodeError(
+		const QuadTree<TerrainNode>::Iterator& node,
+		const HeightGrid& hmap,
+		const float* heights,
+		size_t stride
+		) const;
+	//Distance from the viewpoint divided by the world space error of a node, below which
+	//the error projects to more than pixelTolerance pixels and the node is split
+	float GetLODThreshold() const;
+
 	//Show grid
 	bool showGrid;
 	//Show surface
 	bool showSurface;
 	QuadTree<TerrainNode> heightmap;
 
+	//Receiver of generated geometry; terrain is processed headless if it is null
+	TerrainUploader* uploader = nullptr;
+	//Number of threads generating node data besides the loading one,
+	//negative value means one per hardware core
+	int loadThreadsCount = -1;
+	//Screen-space error of LOD selection: nodes are split while their geometric error
+	//projects to more than pixelTolerance pixels for a camera with vertical field of view
+	//viewFOV degrees drawing to viewportHeight pixels
+	float pixelTolerance = DEFAULT_PIXEL_TOLERANCE;
+	float viewFOV = DEFAULT_VIEW_FOV;
+	float viewportHeight = DEFAULT_VIEWPORT_HEIGHT;
+	//Part of the LOD threshold over which nodes morph to their parents, zero disables geomorphing
+	float morphRange = DEFAULT_MORPH_RANGE;
+	//Storage of samples of heightmaps loaded by LoadFromFile,
+	//HEIGHT_GRID_FLOAT keeps full precision of float heightmaps
+	int heightFormat = HEIGHT_GRID_UINT16;
+	//Bytes of node vertex data kept resident by LoadFromHeights, nodes are generated
+	//on demand when LOD selection needs them; zero keeps all nodes resident.
+	//Used only if the uploader takes node vertices
+	size_t nodeCacheBudget = 0;
+	//Number of threads generating nodes of the node cache
+	int cacheThreadsCount = TERRAIN_CACHE_LOAD_THREADS;
+	//Reorder triangles of generated indices to reuse transformed vertices
+	bool optimizeIndices = true;
+
 private:
-	GLuint indicesBufferID; //VBO for 16 sets of indices
+	vector<uint32_t> indices; //16 sets of indices
 	int indicesBufferSize[16];
-	//Generate sixteen versions of index arrays for each case of sparse/dense egdes
-	void GenerateIndices();
+	int indexSize = sizeof(uint32_t);
+	unsigned int visitedNodesCount = 0;
+
+	//Layer of nodes checked by LOD selection, stored as structure of arrays
+	struct LODLayer
+	{
+		vector<QuadTree<TerrainNode>::Iterator> nodes;
+		//Node bounds and geometric errors in terrain space
+		vector<float> left, right, upper, lower, minHeight, maxHeight, error;
+		//LOD metric of each node: world space distance from the viewpoint to node bounds
+		//divided by world space error of the node, node is split if it is not greater than threshold
+		vector<float> metric;
 
-	//Load all nodes data to GPU recursively
-	vec2 LoadVertices(
+		void Clear();
+		void Add(const QuadTree<TerrainNode>::Iterator& node);
+		//Compute metric of all nodes for a viewpoint given in terrain space,
+		//scale is the scale of the terrain
+		void ComputeMetric(const vec3& viewpoint, const vec3& scale);
+	};
+	//Current and next layers of LOD selection, reused between frames
+	LODLayer lodLayers[2];
+
+	//Incremental LOD selection state
+	bool lodStateValid = false;
+	mat4 lodInverseModel;
+	float lodThreshold = 0.0f;
+	vec3 lodViewpoint;
+	//Distance travelled by the viewpoint in terrain space
+	float lodTravelled = 0.0f;
+	unsigned int reevaluatedNodesCount = 0;
+	LODLayer lodCheckedLayer;
+	//Nodes split by LOD selection and nodes disabled by balancing
+	vector<QuadTree<TerrainNode>::Iterator> splitNodes;
+	vector<QuadTree<TerrainNode>::Iterator> disabledNodes;
+	vector<TerrainRenderItem> renderList;
+	vector<vec3> renderInstances;
+
+	//Frustum culling state: nodes of the render list inside the frustum
+	bool culling = false;
+	mat4 frustumMatrix;
+	vector<TerrainRenderItem> visibleList;
+	vector<vec3> visibleInstances;
+	vector<pair<QuadTree<TerrainNode>::Iterator, int>> cullStack;
+	TerrainCullStatistics cullStatistics;
+	//Geomorphing of nodes of the render list
+	vector<TerrainNodeMorph> renderMorphs;
+
+	//Vertex data of nodes generated by worker threads and waiting for upload
+	struct NodeStaging
+	{
+		vector<vec3> vertices, colors;
+		vector<vec2> morphTargets;
+	};
+	vector<NodeStaging> loadStaging[2];
+
+	//Sample heights of the vertex grid of a node, xs and ys are its coordinates
+	//along both axes, heights go row by row like vertices
+	void SampleNodeGrid(
 		const QuadTree<TerrainNode>::Iterator& node,
-		const Image& hmap
+		const HeightGrid& hmap,
+		vector<float>& xs,
+		vector<float>& ys,
+		vector<float>& heights
+		) const;
+	//Generate data of all nodes in parallel and load it to GPU from the calling thread,
+	//only height ranges are computed if vertices aren't needed
+	void LoadVertices(const HeightGrid& hmap, bool buildVertices);
+	//Upload a batch of generated nodes
+	void UploadBatch(size_t first, vector<NodeStaging>& staging);
+	//Extend height ranges and geometric errors of nodes by their subtrees
+	void UniteSubtreeHeights();
+
+	//Node cache state. Nodes are loaded from the stream if it is open,
+	//otherwise they are generated from the cached heightmap.
+	//Loading threads are stopped before the sources are destroyed
+	TerrainNodeCache nodeCache;
+	HeightGrid cacheHeightmap;
+	TerrainStream stream;
+	TerrainLoadScheduler loadScheduler;
+	size_t streamPendingCount = 0;
+	vector<TerrainLoadedNode> loadedNodes;
+	vector<size_t> cancelledNodes;
+	//Some nodes became resident since the previous selection
+	bool nodesArrived = false;
+	//Nodes whose children must be loaded and nodes which can't be split
+	vector<QuadTree<TerrainNode>::Iterator> streamWanted;
+	vector<QuadTree<TerrainNode>::Iterator> blockedNodes;
+	//Wanted nodes with their LOD metric, the most urgent first
+	LODLayer wantedLayer;
+	vector<pair<float, size_t> > wantedOrder;
+
+	//Start LOD selection with the node cache, returns true if new nodes became resident
+	bool BeginCacheFrame();
+	//Node can be split only if all its children are resident,
+	//otherwise the node is wanted to load its children
+	bool CanSplit(const QuadTree<TerrainNode>::Iterator& node);
+	//Upload nodes loaded since the previous frame
+	void ReceiveLoadedNodes();
+	//Evict nodes unused for the longest time if the budget is exceeded
+	//and request nodes wanted by the current selection, prioritized by LOD metric
+	//of their parents for the viewpoint given in terrain space
+	void RequestNodes(const vec3& viewpoint);
+	//Generate vertex data of a node from the source of the node cache,
+	//called by loading threads
+	bool LoadNode(size_t index, vector<vec3>& vertices, vector<vec3>& colors, vector<vec2>& morphTargets);
+	void MakeResident(
+		const QuadTree<TerrainNode>::Iterator& node,
+		const vector<vec3>& vertices,
+		const vector<vec3>& colors,
+		const vector<vec2>& morphTargets
 		);
+	//Start loading threads and make the root resident
+	void StartNodeCache(size_t budget);
 
-	//Unload all nodes data from GPU recursively
-	void UnloadVertices(const QuadTree<TerrainNode>::Iterator& node);
+	//Allocate complete quadtree and clear state of LOD selection
+	void ResetNodes();
+	//Generate and upload indices, reporting their format and cache efficiency
+	void PrepareIndices();
+	//Unload all nodes data from GPU
+	void UnloadVertices();
 	//Determine which nodes must be rendered
-	void RenewNodes(const vec3& viewpoint, const QuadTree<TerrainNode>::Iterator& node);
-	//Set some neighbour nodes disabled to avoid too big difference in detalization levels
-	void DisableNodes(const QuadTree<TerrainNode>::Iterator& node);
-	//Set all nodes enabled
-	void EnableNodes(const QuadTree<TerrainNode>::Iterator& node);
+	void RenewNodes(const vec3& viewpoint);
+	//Disable split nodes and some of their neighbours to avoid too big difference
+	//in detalization levels, make render list of nodes to draw.
+	//Returns false if a neighbour can't be split while streaming; the nodes requiring it
+	//are blocked then and the selection must be repeated
+	bool BalanceNodes();
+	void AddToRenderList(
+		const QuadTree<TerrainNode>::Iterator& node,
+		vector<TerrainRenderItem>& items,
+		vector<vec3>& instances
+		) const;
+	//Make the list of visible nodes going down from the root: subtrees outside
+	//of a frustum plane are skipped, planes which a subtree is inside aren't tested for its nodes
+	void CullNodes();
+	//Compute geomorphing of the render list nodes for the viewpoint in terrain space
+	void MorphNodes(const vec3& viewpoint);
+	float GetMorphFactor(const QuadTree<TerrainNode>::Iterator& node, const vec3& viewpoint, float threshold) const;
 };
 
 struct TerrainGeneratorNode
@@ -0,0 +1,444 @@
+/*
+	TerrainGrid class
+	Loops over the vertex grid of a node: vertices, morph targets and stitching indices
+*/
+
+#ifndef TERRAIN_GRID_H
+#define TERRAIN_GRID_H
+
+#include "Common.h"
+#include "VertexCache.h"
+#include <vector>
+#include <algorithm>
+
+//Sides of the grid whose every second vertex is skipped to match a coarser neighbour
+#define TERRAIN_GRID_SPARSE_UPPER 8
+#define TERRAIN_GRID_SPARSE_RIGHT 4
+#define TERRAIN_GRID_SPARSE_LOWER 2
+#define TERRAIN_GRID_SPARSE_LEFT 1
+
+//Morph target of a vertex which isn't on an edge of its node
+#define TERRAIN_MORPH_INNER -1.0f
+
+//Range of LOD resolutions: sparse edges skip every second vertex, so the resolution
+//is even and every side has at least two sparse cells
+#define TERRAIN_GRID_MIN_RESOLUTION 4
+#define TERRAIN_GRID_MAX_RESOLUTION 1024
+//Deepest terrain quadtree, all its nodes are allocated at once
+#define TERRAIN_GRID_MAX_LOD 12
+
+//Check LOD resolution and depth of the terrain quadtree
+inline bool IsValidTerrainLOD(int resolution, int maxLOD)
+{
+	return
+		resolution >= TERRAIN_GRID_MIN_RESOLUTION && resolution <= TERRAIN_GRID_MAX_RESOLUTION &&
+		resolution % 2 == 0 &&
+		maxLOD >= 1 && maxLOD <= TERRAIN_GRID_MAX_LOD;
+}
+
+//Grid of (resolution + 1) x (resolution + 1) vertices stored row by row
+class TerrainGrid
+{
+public:
+	TerrainGrid(int resolution) : resolution(resolution) {}
+
+	int GetResolution() const { return resolution; }
+	int GetVerticesCount() const { return (GetResolution() + 1) * (GetResolution() + 1); }
+	//Space taken by each set of indices, sets of all stitching variants are stored one after another
+	int GetIndicesSetSize() const { return GetResolution() * GetResolution() * 6; }
+
+	//Vertices and colors of the grid from its coordinates along both axes and its heights,
+	//returns range of the heights
+	vec2 BuildVertices(const float* xs, const float* ys, const float* heights, vec3* vertices, vec3* colors) const
+	{
+		const int size = GetResolution() + 1, count = size * size;
+		//Range is accumulated by four independent lanes, so comparisons don't wait for each other
+		float minHeight[4] = { 1.0f, 1.0f, 1.0f, 1.0f }, maxHeight[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		int k = 0;
+		for (; k + 4 <= count; k += 4)
+			for (int l = 0; l < 4; l++)
+			{
+				minHeight[l] = heights[k + l] < minHeight[l] ? heights[k + l] : minHeight[l];
+				maxHeight[l] = heights[k + l] > maxHeight[l] ? heights[k + l] : maxHeight[l];
+			}
+		for (; k < count; k++)
+		{
+			minHeight[0] = heights[k] < minHeight[0] ? heights[k] : minHeight[0];
+			maxHeight[0] = heights[k] > maxHeight[0] ? heights[k] : maxHeight[0];
+		}
+		for (int l = 1; l < 4; l++)
+		{
+			minHeight[0] = minHeight[l] < minHeight[0] ? minHeight[l] : minHeight[0];
+			maxHeight[0] = maxHeight[l] > maxHeight[0] ? maxHeight[l] : maxHeight[0];
+		}
+		for (int i = 0; i < size; i++)
+		{
+			const float* row = heights + i * size;
+			for (int j = 0; j < size; j++)
+			{
+				vertices[i * size + j] = vec3(xs[i], row[j], ys[j]);
+				colors[i * size + j] = vec3(0.2f, 0.2f + row[j], 0.4f - row[j]);
+			}
+		}
+		return vec2(minHeight[0], maxHeight[0]);
+	}
+	//Vertices and colors of the grid at offset with spacing delta from 16-bit heights
+	//quantized in heightRange
+	void BuildVertices(vec2 offset, float delta, const uint16_t* heights, vec2 heightRange, vec3* vertices, vec3* colors) const
+	{
+		const int size = GetResolution() + 1;
+		float heightScale = (heightRange.y - heightRange.x) / 65535.0f;
+		float x = offset.x;
+		for (int i = 0; i < size; i++, x += delta)
+		{
+			float y = offset.y;
+			for (int j = 0; j < size; j++, y += delta)
+			{
+				float h = heightRange.x + heights[i * size + j] * heightScale;
+				vertices[i * size + j] = vec3(x, h, y);
+				colors[i * size + j] = vec3(0.2f, 0.2f + h, 0.4f - h);
+			}
+		}
+	}
+	//Height of the parent grid under every vertex and the edge the vertex lies on
+	void BuildMorphTargets(const vec3* vertices, vec2* morphTargets) const
+	{
+		//Parent grid contains every second vertex of the node grid, other vertices lie
+		//on edges or diagonals of its cells, which are split like in the central part of the grid
+		const int res = GetResolution(), size = res + 1;
+		for (int i = 0; i <= res; i++)
+		{
+			const vec3* row0 = vertices + (i - (i & 1)) * size;
+			const vec3* row1 = vertices + glm::min(i + (i & 1), res) * size;
+			vec2* out = morphTargets + i * size;
+			float edge = i == res ? 1.0f : i == 0 ? 3.0f : TERRAIN_MORPH_INNER;
+			int j = 0;
+			for (; j + 1 < res; j += 2)
+			{
+				out[j] = vec2(0.5f * (row0[j].y + row1[j].y), edge);
+				out[j + 1] = vec2(0.5f * (row0[j].y + row1[j + 2].y), edge);
+			}
+			for (; j <= res; j++)
+			{
+				int j0 = j - (j & 1), j1 = glm::min(j + (j & 1), res);
+				out[j] = vec2(0.5f * (row0[j0].y + row1[j1].y), edge);
+			}
+			out[0].y = 0.0f;
+			if (i != res)
+				out[res].y = 2.0f;
+		}
+	}
+
+	//Largest vertical distance between the grid and its parent grid, which is made of
+	//every second vertex like in BuildMorphTargets. Heights go in vertex order
+	float ComputeParentDistance(const float* heights) const
+	{
+		const int res = GetResolution(), size = res + 1;
+		float distance = 0.0f;
+		for (int i = 0; i <= res; i++)
+		{
+			const float* row0 = heights + (i - (i & 1)) * size;
+			const float* row1 = heights + (i + (i & 1)) * size;
+			for (int j = 0; j <= res; j++)
+			{
+				float parent = 0.5f * (row0[j - (j & 1)] + row1[j + (j & 1)]);
+				distance = glm::max(distance, glm::abs(heights[i * size + j] - parent));
+			}
+		}
+		return distance;
+	}
+
+	//Fill sixteen sets of indices, one for each case of sparse/dense edges, counts receive
+	//numbers of used indices. If optimize is set, triangles are reordered for the vertex cache
+	void GenerateIndices(uint32_t* indices, int* counts, bool optimize) const
+	{
+		for (int i = 0; i < 16; i++)
+			counts[i] = GenerateIndices(i, indices + i * GetIndicesSetSize());
+		if (optimize)
+		{
+			VertexCache cache;
+			for (int i = 0; i < 16; i++)
+				cache.Optimize(indices + i * GetIndicesSetSize(), counts[i]);
+		}
+	}
+	//Indices of the grid with stitching variant, triangles go row by row.
+	//Returns number of indices
+	int GenerateIndices(int variant, uint32_t* ptr) const
+	{
+		const int lodResolution = GetResolution();
+		int u, v, count = 0;
+		//
+		//UPPER SIDE
+		//
+		if(variant & TERRAIN_GRID_SPARSE_UPPER)
+		{
+			v = 0;
+			ptr[count++] = v;
+			ptr[count++] = v + lodResolution + 2;
+			ptr[count++] = v + 2;
+
+			ptr[count++] = v + 2;
+			ptr[count++] = v + lodResolution + 2;
+			ptr[count++] = v + lodResolution + 3;
+
+			for (v = 2; v < lodResolution-2 ; v+=2)
+			{
+				ptr[count++] = v;
+				ptr[count++] = v + lodResolution + 1;
+				ptr[count++] = v + lodResolution + 2;
+
+				ptr[count++] = v;
+				ptr[count++] = v + lodResolution + 2;
+				ptr[count++] = v + 2;
+
+				ptr[count++] = v + 2;
+				ptr[count++] = v + lodResolution + 2;
+				ptr[count++] = v + lodResolution + 3;
+			}
+
+			ptr[count++] = v;
+			ptr[count++] = v + lodResolution + 1;
+			ptr[count++] = v + lodResolution + 2;
+
+			ptr[count++] = v;
+			ptr[count++] = v + lodResolution + 2;
+			ptr[count++] = v + 2;
+		}
+		else
+		{
+			v = 0;
+			ptr[count++] = v;
+			ptr[count++] = v + 2 + lodResolution;
+			ptr[count++] = v + 1;
+
+			for (v = 1; v < lodResolution-1 ; v++)
+			{
+				ptr[count++] = v;
+				ptr[count++] = v + 2 + lodResolution;
+				ptr[count++] = v + 1;
+
+				ptr[count++] = v;
+				ptr[count++] = v + lodResolution + 1;
+				ptr[count++] = v + lodResolution + 2;
+			}
+
+			ptr[count++] = v;
+			ptr[count++] = v + 1 + lodResolution;
+			ptr[count++] = v + 1;
+		}
+		//
+		//RIGHT SIDE
+		//
+		if(variant & TERRAIN_GRID_SPARSE_RIGHT)
+		{
+			u = 0;
+			unsigned int aux = u*(lodResolution+1) + lodResolution;
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution;
+			ptr[count++] = aux + 2*lodResolution + 2;
+
+			ptr[count++] = aux + lodResolution;
+			ptr[count++] = aux + 2*lodResolution + 1;
+			ptr[count++] = aux + 2*lodResolution + 2;
+
+			for (u = 2; u < lodResolution-2 ; u+=2)
+			{
+				aux = u*(lodResolution+1) + lodResolution;
+				ptr[count++] = aux;
+				ptr[count++] = aux - 1;
+				ptr[count++] = aux + lodResolution;
+
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution;
+				ptr[count++] = aux + 2*lodResolution + 2;
+
+				ptr[count++] = aux + lodResolution;
+				ptr[count++] = aux + 2*lodResolution + 1;
+				ptr[count++] = aux + 2*lodResolution + 2;
+			}
+
+			aux = u*(lodResolution+1) + lodResolution;
+			ptr[count++] = aux;
+			ptr[count++] = aux - 1;
+			ptr[count++] = aux + lodResolution;
+
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution;
+			ptr[count++] = aux + 2*lodResolution + 2;
+		}
+		else
+		{
+			u = 0;
+			unsigned int aux = u*(lodResolution+1) + lodResolution;
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution;
+			ptr[count++] = aux + lodResolution + 1;
+
+			for (u = 1; u < lodResolution-1 ; u++)
+			{
+				aux = u*(lodResolution+1) + lodResolution;
+				ptr[count++] = aux;
+				ptr[count++] = aux - 1;
+				ptr[count++] = aux + lodResolution;
+
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution;
+				ptr[count++] = aux + lodResolution + 1;
+			}
+			aux = u*(lodResolution+1) + lodResolution;
+			ptr[count++] = aux;
+			ptr[count++] = aux - 1;
+			ptr[count++] = aux + lodResolution + 1;
+		}
+		//
+		//LOWER SIDE
+		//
+		if(variant & TERRAIN_GRID_SPARSE_LOWER)
+		{
+			v = 0;
+			unsigned int aux = (lodResolution-1)*(lodResolution+1) + v;
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + lodResolution + 3;
+
+			ptr[count++] = aux + 2;
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux + lodResolution + 3;
+
+			for (v = 2; v < lodResolution-2 ; v+=2)
+			{
+				aux = (lodResolution-1)*(lodResolution+1) + v;
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 1;
+
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux + lodResolution + 1;
+				ptr[count++] = aux + lodResolution + 3;
+
+				ptr[count++] = aux + 2;
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux + lodResolution + 3;
+			}
+			aux = (lodResolution-1)*(lodResolution+1) + v;
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution + 1;
+
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + lodResolution + 3;
+		}
+		else
+		{
+			v = 0;
+			unsigned int aux = (lodResolution-1)*(lodResolution+1) + v;
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + lodResolution + 2;
+
+			for (v = 1; v < lodResolution-1 ; v++)
+			{
+				aux = (lodResolution-1)*(lodResolution+1) + v;
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 1;
+
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux + lodResolution + 1;
+				ptr[count++] = aux + lodResolution + 2;
+			}
+			aux = (lodResolution - 1)*(lodResolution + 1) + v;
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + lodResolution + 2;
+		}
+		//
+		//LEFT SIDE
+		//
+		if(variant & TERRAIN_GRID_SPARSE_LEFT)
+		{
+			u = 0;
+			unsigned int aux = u*(lodResolution+1);
+			ptr[count++] = aux;
+			ptr[count++] = aux + 2*lodResolution + 2;
+			ptr[count++] = aux + lodResolution + 2;
+
+			ptr[count++] = aux + lodResolution + 2;
+			ptr[count++] = aux + 2*lodResolution + 2;
+			ptr[count++] = aux + 2*lodResolution + 3;
+
+			for (u = 2; u < lodResolution-2 ; u+=2)
+			{
+				aux = u*(lodResolution+1);
+				ptr[count++] = aux + 1;
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 2;
+
+				ptr[count++] = aux;
+				ptr[count++] = aux + 2*lodResolution + 2;
+				ptr[count++] = aux + lodResolution + 2;
+
+				ptr[count++] = aux + lodResolution + 2;
+				ptr[count++] = aux + 2*lodResolution + 2;
+				ptr[count++] = aux + 2*lodResolution + 3;
+			}
+
+			aux = u*(lodResolution+1);
+			ptr[count++] = aux + 1;
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution + 2;
+
+			ptr[count++] = aux;
+			ptr[count++] = aux + 2*lodResolution + 2;
+			ptr[count++] = aux + lodResolution + 2;
+		}
+		else
+		{
+			u = 0;
+			unsigned int aux = u*(lodResolution+1);
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + lodResolution + 2;
+
+			for (u = 1; u < lodResolution-1 ; u++)
+			{
+				aux = u*(lodResolution+1);
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 2;
+				ptr[count++] = aux + 1;
+
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 1;
+				ptr[count++] = aux + lodResolution + 2;
+			}
+			aux = u*(lodResolution+1);
+			ptr[count++] = aux;
+			ptr[count++] = aux + lodResolution + 1;
+			ptr[count++] = aux + 1;
+		}
+		//
+		//CENTRAL PART
+		//
+		for (u = 1; u < lodResolution-1; u++)
+		{
+			for (v = 1; v < lodResolution-1 ; v++)
+			{
+				const unsigned int aux = u*(lodResolution+1) + v;
+				ptr[count++] = aux;
+				ptr[count++] = aux + 2 + lodResolution;
+				ptr[count++] = aux + 1;
+
+				ptr[count++] = aux;
+				ptr[count++] = aux + lodResolution + 1;
+				ptr[count++] = aux + lodResolution + 2;
+			}
+		}
+		return count;
+	}
+
+private:
+	int resolution;
+};
+
+#endif // TERRAIN_GRID_H
@@ -0,0 +1,193 @@
+#include "TerrainLoadScheduler.h"
+#include <algorithm>
+
+void TerrainLoadScheduler::Start(int threadsCount, LoadFunction newLoad)
+{
+	Stop();
+	load = move(newLoad);
+	stopping = false;
+	for (int i = 0; i < std::max(threadsCount, 1); i++)
+		workers.push_back(thread(&TerrainLoadScheduler::WorkerLoop, this));
+}
+
+void TerrainLoadScheduler::Stop()
+{
+	if (!workers.empty())
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (thread& t : workers)
+			t.join();
+		workers.clear();
+	}
+	queued.clear();
+	order.clear();
+	loading.clear();
+	finished.clear();
+	spare.clear();
+	load = LoadFunction();
+}
+
+bool TerrainLoadScheduler::Submit(size_t index, float priority)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		map<size_t, Request>::iterator request = queued.find(index);
+		if (request != queued.end())
+		{
+			order.erase(make_pair(-request->second.priority, index));
+			request->second.priority = priority;
+			request->second.frame = frame;
+			order.insert(make_pair(-priority, index));
+			statistics.deduplicated++;
+			return false;
+		}
+		if (loading.count(index))
+		{
+			statistics.deduplicated++;
+			return false;
+		}
+		Request& added = queued[index];
+		added.priority = priority;
+		added.frame = frame;
+		added.submitted = chrono::steady_clock::now();
+		order.insert(make_pair(-priority, index));
+		statistics.submitted++;
+		statistics.maxQueueDepth = std::max(statistics.maxQueueDepth, queued.size());
+	}
+	wakeup.notify_one();
+	return true;
+}
+
+bool TerrainLoadScheduler::Reprioritize(size_t index, float priority)
+{
+	unique_lock<mutex> guard(lock);
+	map<size_t, Request>::iterator request = queued.find(index);
+	if (request == queued.end())
+		return false;
+	order.erase(make_pair(-request->second.priority, index));
+	request->second.priority = priority;
+	request->second.frame = frame;
+	order.insert(make_pair(-priority, index));
+	return true;
+}
+
+void TerrainLoadScheduler::NextFrame()
+{
+	unique_lock<mutex> guard(lock);
+	frame++;
+}
+
+void TerrainLoadScheduler::CancelStale(vector<size_t>& cancelled)
+{
+	unique_lock<mutex> guard(lock);
+	for (map<size_t, Request>::iterator request = queued.begin(); request != queued.end();)
+	{
+		if (request->second.frame == frame)
+		{
+			++request;
+			continue;
+		}
+		order.erase(make_pair(-request->second.priority, request->first));
+		cancelled.push_back(request->first);
+		request = queued.erase(request);
+		statistics.cancelled++;
+	}
+}
+
+void TerrainLoadScheduler::Collect(vector<TerrainLoadedNode>& nodes)
+{
+	unique_lock<mutex> guard(lock);
+	for (TerrainLoadedNode& node : finished)
+	{
+		loading.erase(node.index);
+		nodes.push_back(move(node));
+	}
+	finished.clear();
+}
+
+void TerrainLoadScheduler::Recycle(vector<TerrainLoadedNode>& nodes)
+{
+	unique_lock<mutex> guard(lock);
+	for (TerrainLoadedNode& node : nodes)
+		spare.push_back(move(node));
+	nodes.clear();
+}
+
+TerrainLoadStatistics TerrainLoadScheduler::GetStatistics() const
+{
+	unique_lock<mutex> guard(lock);
+	TerrainLoadStatistics current = statistics;
+	current.queueDepth = queued.size();
+	current.inFlight = loading.size();
+	return current;
+}
+
+double TerrainLoadScheduler::GetLatencyPercentile(double p) const
+{
+	vector<double> sorted;
+	{
+		unique_lock<mutex> guard(lock);
+		sorted = latencies;
+	}
+	if (sorted.empty())
+		return 0.0;
+	size_t rank = std::min(static_cast<size_t>(p * sorted.size()), sorted.size() - 1);
+	nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+	return sorted[rank];
+}
+
+void TerrainLoadScheduler::ResetStatistics()
+{
+	unique_lock<mutex> guard(lock);
+	statistics = TerrainLoadStatistics();
+	latencies.clear();
+	nextLatency = 0;
+}
+
+void TerrainLoadScheduler::WorkerLoop()
+{
+	for (;;)
+	{
+		TerrainLoadedNode node;
+		chrono::steady_clock::time_point submitted;
+		{
+			unique_lock<mutex> guard(lock);
+			wakeup.wait(guard, [this] { return stopping || !order.empty(); });
+			if (stopping)
+				return;
+			node.index = order.begin()->second;
+			order.erase(order.begin());
+			map<size_t, Request>::iterator request = queued.find(node.index);
+			submitted = request->second.submitted;
+			queued.erase(request);
+			loading.insert(node.index);
+			if (!spare.empty())
+			{
+				node.vertices.swap(spare.back().vertices);
+				node.colors.swap(spare.back().colors);
+				node.morphTargets.swap(spare.back().morphTargets);
+				spare.pop_back();
+			}
+		}
+
+		node.loaded = load(node.index, node.vertices, node.colors, node.morphTargets);
+		double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - submitted).count();
+
+		{
+			unique_lock<mutex> guard(lock);
+			statistics.completed++;
+			if (!node.loaded)
+				statistics.failed++;
+			if (latencies.size() < TERRAIN_LOAD_LATENCY_SAMPLES)
+				latencies.push_back(latency);
+			else
+				latencies[nextLatency] = latency;
+			nextLatency = (nextLatency + 1) % TERRAIN_LOAD_LATENCY_SAMPLES;
+			finished.push_back(move(node));
+		}
+	}
+}
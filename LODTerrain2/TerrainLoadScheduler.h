@@ -0,0 +1,115 @@
+/*
+	TerrainLoadScheduler class
+	Generates data of requested terrain nodes on worker threads,
+	most urgent requests first
+*/
+
+#ifndef TERRAIN_LOAD_SCHEDULER_H
+#define TERRAIN_LOAD_SCHEDULER_H
+
+#include "Common.h"
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+//Number of latest loads whose latency is kept for percentiles
+#define TERRAIN_LOAD_LATENCY_SAMPLES 1024
+
+//Node whose data was generated by the scheduler
+struct TerrainLoadedNode
+{
+	size_t index;
+	bool loaded;
+	vector<vec3> vertices, colors;
+	vector<vec2> morphTargets;
+};
+
+struct TerrainLoadStatistics
+{
+	uint64 submitted = 0;    //requests queued
+	uint64 deduplicated = 0; //requests of nodes already queued or being loaded
+	uint64 cancelled = 0;    //queued requests which became stale
+	uint64 completed = 0;    //loads finished, including failed ones
+	uint64 failed = 0;
+	size_t queueDepth = 0;   //requests waiting for a worker
+	size_t maxQueueDepth = 0;
+	size_t inFlight = 0;     //requests being loaded or not collected yet
+};
+
+class TerrainLoadScheduler
+{
+public:
+	//Generate data of node index, returns false if it failed
+	typedef function<bool(size_t index, vector<vec3>& vertices, vector<vec3>& colors, vector<vec2>& morphTargets)> LoadFunction;
+
+	//Constructor and destructor
+	TerrainLoadScheduler() {}
+	~TerrainLoadScheduler() { Stop(); }
+
+	//Start worker threads calling load for requested nodes
+	void Start(int threadsCount, LoadFunction load);
+	//Stop workers, requests not loaded yet are dropped
+	void Stop();
+	bool IsRunning() const { return !workers.empty(); }
+
+	//Queue loading of the node, requests with higher priority are served first,
+	//coarser nodes first if priorities are equal. If the node is already queued,
+	//only its priority is updated. Returns false if the node is already queued,
+	//being loaded or loaded and not collected yet
+	bool Submit(size_t index, float priority);
+	//Update priority of the queued node and keep its request from becoming stale,
+	//never queues a new request. Returns false if the node isn't queued
+	bool Reprioritize(size_t index, float priority);
+	//Start a new round of requests, queued nodes which aren't submitted again
+	//until CancelStale are stale
+	void NextFrame();
+	//Remove stale requests from the queue and append their nodes to cancelled
+	void CancelStale(vector<size_t>& cancelled);
+	//Append nodes loaded since the last call
+	void Collect(vector<TerrainLoadedNode>& nodes);
+	//Return collected nodes, so their buffers are reused by next loads
+	void Recycle(vector<TerrainLoadedNode>& nodes);
+
+	TerrainLoadStatistics GetStatistics() const;
+	//Time from submission to completion of latest loads in milliseconds, p is in [0, 1]
+	double GetLatencyPercentile(double p) const;
+	void ResetStatistics();
+
+private:
+	TerrainLoadScheduler(const TerrainLoadScheduler&);
+	TerrainLoadScheduler& operator=(const TerrainLoadScheduler&);
+
+	void WorkerLoop();
+
+	struct Request
+	{
+		float priority;
+		unsigned int frame;
+		chrono::steady_clock::time_point submitted;
+	};
+
+	LoadFunction load;
+	vector<thread> workers;
+	mutable mutex lock;
+	condition_variable wakeup;
+	//Queued requests and their order: negated priority and index
+	map<size_t, Request> queued;
+	std::set<pair<float, size_t> > order;
+	//Nodes being loaded or not collected yet
+	std::set<size_t> loading;
+	vector<TerrainLoadedNode> finished;
+	vector<TerrainLoadedNode> spare;
+	unsigned int frame = 0;
+	bool stopping = false;
+	TerrainLoadStatistics statistics;
+	//Ring of latest latencies in milliseconds
+	vector<double> latencies;
+	size_t nextLatency = 0;
+};
+
+#endif // TERRAIN_LOAD_SCHEDULER_H
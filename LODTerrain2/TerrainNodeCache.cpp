@@ -0,0 +1,84 @@
+#include "TerrainNodeCache.h"
+#include "Terrain.h"
+#include <algorithm>
+
+void TerrainNodeCache::Reset(size_t budget, size_t bytes, size_t minCapacity)
+{
+	Clear();
+	nodeBytes = bytes;
+	capacity = std::max<size_t>(budget / nodeBytes, minCapacity);
+}
+
+void TerrainNodeCache::Clear()
+{
+	capacity = 0;
+	frame = 0;
+	residentNodes.clear();
+	candidates.clear();
+	ResetStatistics();
+}
+
+void TerrainNodeCache::ResetStatistics()
+{
+	statistics = TerrainCacheStatistics();
+	statistics.residentBytes = statistics.peakResidentBytes = residentNodes.size() * nodeBytes;
+}
+
+void TerrainNodeCache::Touch(TerrainNode& node) const
+{
+	node.lastUsedFrame = frame;
+}
+
+bool TerrainNodeCache::Lookup(TerrainNode& node)
+{
+	if (!node.resident)
+	{
+		statistics.misses++;
+		return false;
+	}
+	statistics.hits++;
+	Touch(node);
+	return true;
+}
+
+void TerrainNodeCache::Insert(size_t index, TerrainNode& node)
+{
+	node.resident = true;
+	Touch(node);
+	residentNodes.push_back(index);
+	statistics.insertions++;
+	statistics.residentBytes = residentNodes.size() * nodeBytes;
+	statistics.peakResidentBytes = std::max(statistics.peakResidentBytes, statistics.residentBytes);
+}
+
+size_t TerrainNodeCache::Evict(
+	size_t count,
+	vector<TerrainNode>& nodes,
+	function<bool(size_t)> evictable,
+	function<void(TerrainNode&)> unload
+	)
+{
+	candidates.clear();
+	for (size_t index : residentNodes)
+		if (nodes[index].lastUsedFrame != frame && evictable(index))
+			candidates.push_back(make_pair(nodes[index].lastUsedFrame, index));
+	count = std::min(count, candidates.size());
+	partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+	for (size_t i = 0; i < count; i++)
+	{
+		TerrainNode& node = nodes[candidates[i].second];
+		unload(node);
+		node.resident = false;
+	}
+	if (count > 0)
+	{
+		residentNodes.erase(
+			remove_if(residentNodes.begin(), residentNodes.end(),
+				[&](size_t index) { return !nodes[index].resident; }),
+			residentNodes.end()
+			);
+		statistics.evictions += count;
+		statistics.residentBytes = residentNodes.size() * nodeBytes;
+	}
+	return count;
+}
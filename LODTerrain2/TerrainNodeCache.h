@@ -0,0 +1,77 @@
+/*
+	TerrainNodeCache class
+	Keeps track of terrain nodes resident in GPU memory under a byte budget
+*/
+
+#ifndef TERRAIN_NODE_CACHE_H
+#define TERRAIN_NODE_CACHE_H
+
+#include "Common.h"
+#include <vector>
+#include <functional>
+
+struct TerrainNode;
+
+struct TerrainCacheStatistics
+{
+	uint64 hits = 0;       //lookups of wanted nodes which were resident
+	uint64 misses = 0;     //lookups of wanted nodes which had to be loaded
+	uint64 insertions = 0;
+	uint64 evictions = 0;
+	size_t residentBytes = 0;
+	size_t peakResidentBytes = 0;
+
+	double GetHitRate() const
+	{
+		return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 1.0;
+	}
+};
+
+//Nodes are identified by their position in the heightmap storage,
+//which is unique for each pair of level and offset.
+//Residency and last use are stored in the nodes themselves
+class TerrainNodeCache
+{
+public:
+	//Start caching of nodes taking nodeBytes each in budget bytes,
+	//at least minCapacity nodes are kept
+	void Reset(size_t budget, size_t nodeBytes, size_t minCapacity);
+	void Clear();
+	bool IsEnabled() const { return capacity > 0; }
+
+	//Maximal number of resident nodes
+	size_t GetCapacity() const { return capacity; }
+	size_t GetNodeBytes() const { return nodeBytes; }
+	const vector<size_t>& GetResidentNodes() const { return residentNodes; }
+	const TerrainCacheStatistics& GetStatistics() const { return statistics; }
+	void ResetStatistics();
+
+	//Start a new frame of LOD selection
+	void NextFrame() { frame++; }
+	//Mark the node as used by the current frame
+	void Touch(TerrainNode& node) const;
+	//Check if the node wanted by the current frame is resident and keep it then
+	bool Lookup(TerrainNode& node);
+	//Make the node resident
+	void Insert(size_t index, TerrainNode& node);
+	//Evict at most count nodes not used by the current frame, least recently used first.
+	//Only nodes accepted by evictable are evicted, unload releases their data.
+	//Returns number of evicted nodes
+	size_t Evict(
+		size_t count,
+		vector<TerrainNode>& nodes,
+		function<bool(size_t)> evictable,
+		function<void(TerrainNode&)> unload
+		);
+
+private:
+	size_t capacity = 0;
+	size_t nodeBytes = 0;
+	unsigned int frame = 0;
+	vector<size_t> residentNodes;
+	//Eviction candidates: last use and index
+	vector<pair<unsigned int, size_t> > candidates;
+	TerrainCacheStatistics statistics;
+};
+
+#endif // TERRAIN_NODE_CACHE_H
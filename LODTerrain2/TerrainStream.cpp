@@ -0,0 +1,171 @@
+#include "TerrainStream.h"
+
+#ifdef _WIN32
+#define TERRAIN_STREAM_FSEEK _fseeki64
+#else
+#define TERRAIN_STREAM_FSEEK fseeko
+#endif
+
+static uint64 AlignOffset(uint64 offset)
+{
+	return (offset + TERRAIN_STREAM_ALIGNMENT - 1) / TERRAIN_STREAM_ALIGNMENT * TERRAIN_STREAM_ALIGNMENT;
+}
+
+bool TerrainStream::Open(const string& filename)
+{
+	Close();
+	if (!file.Open(filename))
+	{
+		WriteToLog("ERROR: Can't open terrain pyramid %s\n", filename.c_str());
+		return false;
+	}
+	if (file.GetSize() < sizeof(header))
+		header.magic = 0;
+	else
+		memcpy(&header, file.GetData(), sizeof(header));
+	if (header.magic != TERRAIN_STREAM_MAGIC || header.version != TERRAIN_STREAM_VERSION)
+	{
+		WriteToLog("ERROR: %s is not a terrain pyramid of version %d\n", filename.c_str(), TERRAIN_STREAM_VERSION);
+		Close();
+		return false;
+	}
+	//Nodes of the complete quadtree are allocated by the header, so its size is checked first
+	if (!IsValidTerrainLOD(header.lodResolution, header.maxLOD) ||
+		header.nodesCount != ((uint64(1) << (2 * (header.maxLOD + 1))) - 1) / 3)
+	{
+		WriteToLog("ERROR: Terrain pyramid %s has invalid LOD resolution or number of nodes\n", filename.c_str());
+		Close();
+		return false;
+	}
+	uint64 samplesSize = GetNodeSamplesCount() * sizeof(uint16_t);
+	if (header.boundsOffset + header.nodesCount * sizeof(vec2) > file.GetSize() ||
+		header.errorsOffset + header.nodesCount * sizeof(float) > file.GetSize() ||
+		header.nodeStride < samplesSize ||
+		header.nodesCount == 0 ||
+		header.nodesOffset + (header.nodesCount - 1) * header.nodeStride + samplesSize > file.GetSize() ||
+		header.boundsOffset % alignof(vec2) != 0 ||
+		header.errorsOffset % alignof(float) != 0 ||
+		header.nodesOffset % alignof(uint16_t) != 0 ||
+		header.nodeStride % alignof(uint16_t) != 0)
+	{
+		WriteToLog("ERROR: Terrain pyramid %s is truncated or damaged\n", filename.c_str());
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void TerrainStream::Close()
+{
+	file.Close();
+}
+
+bool TerrainStream::Write(
+	const string& filename,
+	TerrainStreamHeader header,
+	const vector<vec2>& bounds,
+	const vector<float>& errors,
+	function<void(size_t, vector<float>&)> nodeHeights
+	)
+{
+	if (bounds.size() != header.nodesCount || errors.size() != header.nodesCount)
+	{
+		WriteToLog("ERROR: Terrain pyramid %s needs bounds and errors of %s nodes, got %s and %s\n",
+			filename.c_str(), ToString(header.nodesCount).c_str(),
+			ToString(bounds.size()).c_str(), ToString(errors.size()).c_str());
+		return false;
+	}
+	TerrainStreamWriter writer;
+	if (!writer.Create(filename, header))
+		return false;
+	size_t samplesCount = (header.lodResolution + 1) * (header.lodResolution + 1);
+	vector<float> heights;
+	bool ok = true;
+	for (size_t i = 0; ok && i < header.nodesCount; i++)
+	{
+		nodeHeights(i, heights);
+		ok = heights.size() == samplesCount && writer.WriteNode(i, heights.data());
+	}
+	//Finish reports the failure if some node wasn't written
+	return writer.Finish(bounds, errors);
+}
+
+bool TerrainStreamWriter::Create(const string& newFilename, const TerrainStreamHeader& newHeader)
+{
+	Close();
+	header = newHeader;
+	size_t samplesCount = (header.lodResolution + 1) * (header.lodResolution + 1);
+	header.boundsOffset = AlignOffset(sizeof(header));
+	header.errorsOffset = AlignOffset(header.boundsOffset + header.nodesCount * sizeof(vec2));
+	header.nodesOffset = AlignOffset(header.errorsOffset + header.nodesCount * sizeof(float));
+	header.nodeStride = AlignOffset(samplesCount * sizeof(uint16_t));
+	float range = header.heightMax - header.heightMin;
+	quantization = range > 0.0f ? 65535.0f / range : 0.0f;
+	quantized.assign(header.nodeStride / sizeof(uint16_t), 0);
+
+	filename = newFilename;
+	file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		WriteToLog("ERROR: Can't create terrain pyramid %s\n", filename.c_str());
+		return false;
+	}
+	//Gaps between the header and the tables are filled with zeros by writes after them
+	position = 0;
+	writtenNodes = 0;
+	failed = fwrite(&header, sizeof(header), 1, file) != 1;
+	position = sizeof(header);
+	return !failed;
+}
+
+bool TerrainStreamWriter::Seek(uint64 offset)
+{
+	//Nodes written in storage order follow each other without seeking
+	if (offset != position)
+		failed = failed || TERRAIN_STREAM_FSEEK(file, offset, SEEK_SET) != 0;
+	position = offset;
+	return !failed;
+}
+
+bool TerrainStreamWriter::WriteNode(size_t index, const float* heights)
+{
+	if (!file || failed || index >= header.nodesCount)
+		return false;
+	size_t samplesCount = (header.lodResolution + 1) * (header.lodResolution + 1);
+	for (size_t j = 0; j < samplesCount; j++)
+	{
+		float q = (heights[j] - header.heightMin) * quantization + 0.5f;
+		quantized[j] = static_cast<uint16_t>(glm::clamp(q, 0.0f, 65535.0f));
+	}
+	if (!Seek(header.nodesOffset + index * header.nodeStride))
+		return false;
+	failed = fwrite(quantized.data(), sizeof(uint16_t), quantized.size(), file) != quantized.size();
+	position += header.nodeStride;
+	writtenNodes++;
+	return !failed;
+}
+
+bool TerrainStreamWriter::Finish(const vector<vec2>& bounds, const vector<float>& errors)
+{
+	if (!file)
+		return false;
+	bool ok =
+		!failed && writtenNodes == header.nodesCount &&
+		bounds.size() == header.nodesCount && errors.size() == header.nodesCount &&
+		Seek(header.boundsOffset) &&
+		fwrite(bounds.data(), sizeof(vec2), bounds.size(), file) == bounds.size() &&
+		Seek(header.errorsOffset) &&
+		fwrite(errors.data(), sizeof(float), errors.size(), file) == errors.size();
+	ok = (fclose(file) == 0) && ok;
+	file = nullptr;
+	if (!ok)
+		WriteToLog("ERROR: Failed to write terrain pyramid %s\n", filename.c_str());
+	return ok;
+}
+
+void TerrainStreamWriter::Close()
+{
+	if (file)
+		fclose(file);
+	file = nullptr;
+}
@@ -0,0 +1,127 @@
+/*
+	TerrainStream class
+	Serves node data of a memory-mapped terrain pyramid file
+*/
+
+#ifndef TERRAIN_STREAM_H
+#define TERRAIN_STREAM_H
+
+#include "Common.h"
+#include "MappedFile.h"
+#include "TerrainGrid.h"
+#include <vector>
+#include <functional>
+
+//Terrain pyramid file:
+//  header: TerrainStreamHeader
+//  bounds: range of heights of every node subtree (two floats), in heightmap storage order
+//  errors: geometric error of every node (float), in the same order
+//  nodes:  (lodResolution+1)^2 quantized heights of every node, in the same order,
+//          each node starts at a multiple of TERRAIN_STREAM_ALIGNMENT
+//Node heights are stored in the vertex order of Terrain::BuildNodeVertices,
+//height is heightMin + q / 65535 * (heightMax - heightMin)
+#define TERRAIN_STREAM_MAGIC 0x50444F4C //"LODP"
+#define TERRAIN_STREAM_VERSION 4
+#define TERRAIN_STREAM_ALIGNMENT 16
+
+struct TerrainStreamHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t lodResolution;
+	uint32_t maxLOD;
+	uint64 nodesCount;
+	//Position of tables in the file
+	uint64 boundsOffset;
+	uint64 errorsOffset;
+	uint64 nodesOffset;
+	uint64 nodeStride;
+	//Range of quantized heights
+	float heightMin;
+	float heightMax;
+};
+
+class TerrainStream
+{
+public:
+	//Constructor and destructor
+	TerrainStream() {}
+	~TerrainStream() { Close(); }
+
+	//Map pyramid file and check its header
+	bool Open(const string& filename);
+	void Close();
+	bool IsOpen() const { return file.IsOpen(); }
+
+	const TerrainStreamHeader& GetHeader() const { return header; }
+	//Bounds of all nodes, stored in the mapped file
+	const vec2* GetBounds() const { return reinterpret_cast<const vec2*>(file.GetData() + header.boundsOffset); }
+	//Geometric errors of all nodes, stored in the mapped file
+	const float* GetErrors() const { return reinterpret_cast<const float*>(file.GetData() + header.errorsOffset); }
+	//Quantized heights of the node, stored in the mapped file.
+	//Pages are read from disk by the first access, so it is done by loading threads
+	const uint16_t* GetNodeHeights(size_t index) const
+	{
+		return reinterpret_cast<const uint16_t*>(file.GetData() + header.nodesOffset + index * header.nodeStride);
+	}
+	//Number of heights of each node
+	size_t GetNodeSamplesCount() const { return (header.lodResolution + 1) * (header.lodResolution + 1); }
+
+	//Write pyramid file, nodeHeights is called for every node in storage order
+	//and gets unquantized heights. Header is completed with tables layout.
+	//Fails without creating the file unless bounds and errors have header.nodesCount entries
+	static bool Write(
+		const string& filename,
+		TerrainStreamHeader header,
+		const vector<vec2>& bounds,
+		const vector<float>& errors,
+		function<void(size_t, vector<float>&)> nodeHeights
+		);
+
+private:
+	TerrainStream(const TerrainStream&);
+	TerrainStream& operator=(const TerrainStream&);
+
+	MappedFile file;
+	TerrainStreamHeader header;
+};
+
+//Writes pyramid file whose nodes come in any order, tables of bounds and errors
+//are written last, when all nodes are known
+class TerrainStreamWriter
+{
+public:
+	//Constructor and destructor
+	TerrainStreamWriter() {}
+	~TerrainStreamWriter() { Close(); }
+
+	//Create file and write the header completed with tables layout
+	bool Create(const string& filename, const TerrainStreamHeader& header);
+	//Quantize and write GetHeader().lodResolution + 1 squared heights of the node
+	bool WriteNode(size_t index, const float* heights);
+	//Write tables of all nodes in storage order and close the file.
+	//Fails if any write failed or not every node was written
+	bool Finish(const vector<vec2>& bounds, const vector<float>& errors);
+	//Close the file, it stays incomplete unless Finish was called
+	void Close();
+
+	const TerrainStreamHeader& GetHeader() const { return header; }
+
+private:
+	TerrainStreamWriter(const TerrainStreamWriter&);
+	TerrainStreamWriter& operator=(const TerrainStreamWriter&);
+
+	//Continue writing from the offset
+	bool Seek(uint64 offset);
+
+	FILE* file = nullptr;
+	string filename;
+	TerrainStreamHeader header;
+	uint64 position = 0;
+	size_t writtenNodes = 0;
+	bool failed = false;
+	float quantization = 0.0f;
+	vector<uint16_t> quantized;
+};
+
+#endif // TERRAIN_STREAM_H
@@ -0,0 +1,57 @@
+/*
+	TerrainUploader class
+	Interface between the terrain geometry generation and the graphics API
+	which stores the generated data in GPU memory
+*/
+
+#ifndef TERRAIN_UPLOADER_H
+#define TERRAIN_UPLOADER_H
+
+#include "Common.h"
+#include <vector>
+
+struct TerrainNode;
+class HeightGrid;
+
+class TerrainUploader
+{
+public:
+	virtual ~TerrainUploader() {}
+
+	//Store sixteen sets of indices shared by all nodes,
+	//indexSize is 2 for 16-bit indices or 4 for 32-bit ones
+	virtual void UploadIndices(const void* indices, size_t count, size_t indexSize) = 0;
+	//Release shared indices
+	virtual void UnloadIndices() = 0;
+
+	//Prepare storage for vertex data of all nodes before they are uploaded
+	virtual void Reserve(size_t /*nodesCount*/, size_t /*verticesPerNode*/) {}
+	//Release storage prepared by Reserve
+	virtual void Release() {}
+
+	//Store the whole heightmap, for uploaders sampling heights on GPU
+	virtual void UploadHeightmap(const HeightGrid& /*hmap*/, int /*lodResolution*/) {}
+	//If false, vertex data of nodes is not generated and UploadNode is not called
+	virtual bool UsesNodeVertices() const { return true; }
+
+	//Store vertex data of the node and keep its handles in the node,
+	//index is the position of the node in the heightmap storage.
+	//Morph targets are made by Terrain::BuildMorphTargets
+	virtual void UploadNode(
+		size_t index,
+		TerrainNode& node,
+		const vector<vec3>& vertices,
+		const vector<vec3>& colors,
+		const vector<vec2>& morphTargets
+		) = 0;
+	//Release vertex data of the node
+	virtual void UnloadNode(TerrainNode& node) = 0;
+	//Called after a batch of UploadNode calls, so the uploader can fence its transfers
+	virtual void FlushUploads() {}
+
+	//Bytes of GPU memory taken by vertex data of the terrain
+	//(vertex buffers and heightmap texture, indices are not counted)
+	virtual size_t GetVertexMemoryUsage() const { return 0; }
+};
+
+#endif // TERRAIN_UPLOADER_H
@@ -0,0 +1,93 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threadsCount) : nextTask(0)
+{
+	if (threadsCount < 0)
+		threadsCount = static_cast<int>(thread::hardware_concurrency()) - 1;
+	for (int i = 0; i < threadsCount; i++)
+		threads.push_back(thread(&ThreadPool::WorkerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (thread& t : threads)
+		t.join();
+}
+
+void ThreadPool::Start(size_t count, function<void(size_t)> newTask)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		task = move(newTask);
+		tasksCount = count;
+		nextTask = 0;
+		busyWorkers = GetThreadsCount();
+		generation++;
+	}
+	wakeup.notify_all();
+}
+
+void ThreadPool::Wait()
+{
+	Execute();
+	unique_lock<mutex> guard(lock);
+	finished.wait(guard, [this] { return busyWorkers == 0; });
+	if (error)
+	{
+		exception_ptr e = error;
+		error = nullptr;
+		rethrow_exception(e);
+	}
+}
+
+void ThreadPool::Run(size_t count, function<void(size_t)> newTask)
+{
+	Start(count, move(newTask));
+	Wait();
+}
+
+void ThreadPool::WorkerLoop()
+{
+	unsigned int seenGeneration = 0;
+	for (;;)
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			wakeup.wait(guard, [&] { return stopping || generation != seenGeneration; });
+			if (stopping)
+				return;
+			seenGeneration = generation;
+		}
+		Execute();
+		{
+			unique_lock<mutex> guard(lock);
+			if (--busyWorkers == 0)
+				finished.notify_all();
+		}
+	}
+}
+
+void ThreadPool::Execute()
+{
+	for (;;)
+	{
+		size_t i = nextTask++;
+		if (i >= tasksCount)
+			return;
+		try
+		{
+			task(i);
+		}
+		catch (...)
+		{
+			unique_lock<mutex> guard(lock);
+			if (!error)
+				error = current_exception();
+		}
+	}
+}
@@ -0,0 +1,60 @@
+/*
+	ThreadPool class
+	Fixed set of worker threads running indexed tasks
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "Common.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+class ThreadPool
+{
+public:
+	//Create pool with given number of worker threads,
+	//by default one thread per hardware core except the calling one
+	ThreadPool(int threadsCount = -1);
+	~ThreadPool();
+
+	//Start task(i) for every i in [0, count) and return immediately.
+	//Workers take indices one by one, so uneven tasks are balanced between them
+	void Start(size_t count, function<void(size_t)> task);
+	//Help to run remaining tasks and wait until all of them are done.
+	//Rethrows the first exception thrown by the tasks
+	void Wait();
+	//Start and wait
+	void Run(size_t count, function<void(size_t)> task);
+
+	int GetThreadsCount() const { return static_cast<int>(threads.size()); }
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void WorkerLoop();
+	void Execute();
+
+	vector<thread> threads;
+	mutex lock;
+	condition_variable wakeup;
+	condition_variable finished;
+	//Current task
+	function<void(size_t)> task;
+	size_t tasksCount = 0;
+	atomic<size_t> nextTask;
+	//Number of workers which have not finished the current task yet
+	int busyWorkers = 0;
+	//Incremented by each Start to wake up workers
+	unsigned int generation = 0;
+	bool stopping = false;
+	exception_ptr error;
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,154 @@
+#include "VertexCache.h"
+#include <algorithm>
+
+//Parameters of the vertex score function from the description of the algorithm
+#define VERTEX_CACHE_DECAY_POWER 1.5f
+#define VERTEX_CACHE_LAST_TRIANGLE_SCORE 0.75f
+#define VERTEX_CACHE_VALENCE_BOOST_SCALE 2.0f
+#define VERTEX_CACHE_VALENCE_BOOST_POWER 0.5f
+
+//Scores are tabulated for valences up to this, grid vertices have at most 8 triangles
+#define VERTEX_CACHE_MAX_TABLE_VALENCE 32
+
+inline float GetValenceScore(uint32_t trianglesLeft)
+{
+	return VERTEX_CACHE_VALENCE_BOOST_SCALE * pow(static_cast<float>(trianglesLeft), -VERTEX_CACHE_VALENCE_BOOST_POWER);
+}
+
+VertexCache::VertexCache(int size) : size(glm::max(size, 4))
+{
+	//Vertices of the last triangle get a fixed score, so the next triangle
+	//doesn't just take two of them back and leave a long thin strip
+	positionScores.resize(this->size);
+	for (int i = 0; i < this->size; i++)
+		positionScores[i] = i < 3 ? VERTEX_CACHE_LAST_TRIANGLE_SCORE :
+			pow(1.0f - static_cast<float>(i - 3) / (this->size - 3), VERTEX_CACHE_DECAY_POWER);
+	valenceScores.resize(VERTEX_CACHE_MAX_TABLE_VALENCE + 1);
+	for (uint32_t i = 1; i <= VERTEX_CACHE_MAX_TABLE_VALENCE; i++)
+		valenceScores[i] = GetValenceScore(i);
+}
+
+float VertexCache::GetVertexScore(int cachePosition, uint32_t left) const
+{
+	//Vertex without triangles left is never used again
+	if (left == 0)
+		return -1.0f;
+	float score = cachePosition >= 0 ? positionScores[cachePosition] : 0.0f;
+	//Vertices with few triangles left are finished first, so they leave the cache for good
+	return score + (left <= VERTEX_CACHE_MAX_TABLE_VALENCE ? valenceScores[left] : GetValenceScore(left));
+}
+
+void VertexCache::Optimize(uint32_t* indices, size_t count)
+{
+	const size_t none = static_cast<size_t>(-1);
+	size_t trianglesCount = count / 3;
+	if (trianglesCount < 2)
+		return;
+	uint32_t verticesCount = *max_element(indices, indices + trianglesCount * 3) + 1;
+
+	//Triangles of every vertex, the first trianglesLeft[v] of them aren't drawn yet
+	vertexOffsets.assign(verticesCount + 1, 0);
+	for (size_t i = 0; i < trianglesCount * 3; i++)
+		vertexOffsets[indices[i] + 1]++;
+	for (uint32_t v = 0; v < verticesCount; v++)
+		vertexOffsets[v + 1] += vertexOffsets[v];
+	trianglesLeft.assign(verticesCount, 0);
+	vertexTriangles.resize(trianglesCount * 3);
+	for (size_t t = 0; t < trianglesCount; t++)
+		for (int k = 0; k < 3; k++)
+		{
+			uint32_t v = indices[3 * t + k];
+			vertexTriangles[vertexOffsets[v] + trianglesLeft[v]++] = static_cast<uint32_t>(t);
+		}
+
+	cachePositions.assign(verticesCount, -1);
+	vertexScores.resize(verticesCount);
+	for (uint32_t v = 0; v < verticesCount; v++)
+		vertexScores[v] = GetVertexScore(-1, trianglesLeft[v]);
+	triangleScores.resize(trianglesCount);
+	drawnTriangles.assign(trianglesCount, false);
+	size_t best = 0;
+	for (size_t t = 0; t < trianglesCount; t++)
+	{
+		const uint32_t* triangle = indices + 3 * t;
+		triangleScores[t] = vertexScores[triangle[0]] + vertexScores[triangle[1]] + vertexScores[triangle[2]];
+		if (triangleScores[t] > triangleScores[best])
+			best = t;
+	}
+
+	output.clear();
+	cache.clear();
+	for (size_t drawn = 0; drawn < trianglesCount; drawn++)
+	{
+		//If no cached vertex has triangles left, the best of all triangles starts anew
+		if (best == none)
+		{
+			for (size_t t = 0; t < trianglesCount; t++)
+				if (!drawnTriangles[t] && (best == none || triangleScores[t] > triangleScores[best]))
+					best = t;
+		}
+		drawnTriangles[best] = true;
+		const uint32_t* triangle = indices + 3 * best;
+		output.insert(output.end(), triangle, triangle + 3);
+		for (int k = 0; k < 3; k++)
+		{
+			uint32_t v = triangle[k];
+			uint32_t* first = &vertexTriangles[vertexOffsets[v]];
+			uint32_t* last = first + --trianglesLeft[v];
+			swap(*find(first, last, static_cast<uint32_t>(best)), *last);
+		}
+
+		//Vertices of the triangle go to the front of the cache, the others are shifted
+		//and the last ones fall out of it
+		nextCache.assign(triangle, triangle + 3);
+		for (uint32_t v : cache)
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				nextCache.push_back(v);
+		for (size_t i = 0; i < nextCache.size(); i++)
+		{
+			uint32_t v = nextCache[i];
+			cachePositions[v] = i < static_cast<size_t>(size) ? static_cast<int>(i) : -1;
+			vertexScores[v] = GetVertexScore(cachePositions[v], trianglesLeft[v]);
+		}
+
+		//Scores of triangles of the vertices are updated,
+		//the next triangle is the best one using cached vertices
+		best = none;
+		for (size_t i = 0; i < nextCache.size(); i++)
+		{
+			uint32_t v = nextCache[i];
+			const uint32_t* triangles = &vertexTriangles[vertexOffsets[v]];
+			for (uint32_t j = 0; j < trianglesLeft[v]; j++)
+			{
+				uint32_t t = triangles[j];
+				const uint32_t* vertices = indices + 3 * t;
+				triangleScores[t] = vertexScores[vertices[0]] + vertexScores[vertices[1]] + vertexScores[vertices[2]];
+				if (i < static_cast<size_t>(size) && (best == none || triangleScores[t] > triangleScores[best]))
+					best = t;
+			}
+		}
+		nextCache.resize(glm::min(nextCache.size(), static_cast<size_t>(size)));
+		swap(cache, nextCache);
+	}
+	copy(output.begin(), output.end(), indices);
+}
+
+float VertexCache::ComputeACMR(const uint32_t* indices, size_t count)
+{
+	size_t trianglesCount = count / 3;
+	if (trianglesCount == 0)
+		return 0.0f;
+	uint32_t verticesCount = *max_element(indices, indices + trianglesCount * 3) + 1;
+
+	//Vertex is in the cache if fewer than size vertices were stored after it,
+	//times are counted from one, zero means the vertex wasn't stored yet
+	cacheTimes.assign(verticesCount, 0);
+	size_t misses = 0;
+	for (size_t i = 0; i < trianglesCount * 3; i++)
+	{
+		size_t& time = cacheTimes[indices[i]];
+		if (time == 0 || misses - time >= static_cast<size_t>(size))
+			time = ++misses;
+	}
+	return static_cast<float>(misses) / trianglesCount;
+}
@@ -0,0 +1,52 @@
+/*
+	VertexCache class
+	Model of the post-transform vertex cache of GPU: reordering of triangles
+	for it and simulation of its misses
+*/
+
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include "Common.h"
+#include <vector>
+
+//Number of transformed vertices kept by the modelled cache
+#define VERTEX_CACHE_SIZE 32
+
+//Vertices are kept first in first out, like post-transform caches of most GPUs.
+//Scratch memory is kept between calls, so index lists of similar size
+//are processed without allocations
+class VertexCache
+{
+public:
+	VertexCache(int size = VERTEX_CACHE_SIZE);
+
+	int GetSize() const { return size; }
+
+	//Reorder triangles of the list, so consecutive triangles reuse cached vertices
+	//(linear-speed vertex cache optimisation by Tom Forsyth). Vertices of triangles
+	//keep their order, so the winding is the same
+	void Optimize(uint32_t* indices, size_t count);
+	//Average number of cache misses, that is vertex shader invocations, per triangle
+	float ComputeACMR(const uint32_t* indices, size_t count);
+
+private:
+	int size;
+
+	//Score of a vertex by its position in the cache and number of triangles left to draw
+	float GetVertexScore(int cachePosition, uint32_t trianglesLeft) const;
+	//Tabulated parts of vertex scores
+	vector<float> positionScores, valenceScores;
+
+	//Triangles using each vertex: vertexTriangles[vertexOffsets[v]...vertexOffsets[v + 1]]
+	vector<uint32_t> vertexOffsets, vertexTriangles;
+	vector<uint32_t> trianglesLeft;
+	vector<int> cachePositions;
+	vector<float> vertexScores, triangleScores;
+	vector<bool> drawnTriangles;
+	vector<uint32_t> cache, nextCache, output;
+	//Simulation: number of misses when each vertex was stored in the cache
+	vector<size_t> cacheTimes;
+};
+
+#endif // VERTEX_CACHE_H
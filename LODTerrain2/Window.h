@@ -1,7 +1,7 @@
 #ifndef WINDOW_H
 #define WINDOW_H
 
-#include "Common.h"
+#include "GLCommon.h"
 #include "Shader.h"
 #include <vector>
 